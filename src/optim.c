@@ -6,16 +6,46 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <getopt.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #define OPTIM_USAGE_WIDTH_ARGS 30
-#define OPTIM_USAGE_WIDTH_HELP 50
+#define OPTIM_USAGE_WIDTH_HELP 50   // If the width of the terminal isn't known
+#define OPTIM_USAGE_MIN_HELP 20     // On narrow terminals
+#define OPTIM_STREAM_BUFFER_SIZE 65536
+
+// Arguments are classified a block at a time with SSE2, or AVX2 if it's enabled (`-mavx2`)
+// The aligned loads can read past the end of a string, but never into the next page; sanitizers
+// can't tell that it's safe, so they get the scalar loop, as does `-DOPTIM_NO_SIMD`
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define OPTIM_NO_SIMD
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer) || __has_feature(thread_sanitizer)
+#define OPTIM_NO_SIMD
+#endif
+#endif
+#if !defined(OPTIM_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define OPTIM_SIMD_WIDTH 32
+#elif !defined(OPTIM_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define OPTIM_SIMD_WIDTH 16
+#endif
+
+extern char ** environ;
 
 #define OPTIM_INVALID (assert(0), fprintf(stderr, "Internal optim error: `%s` called with NULL `optim` parameter. Was `optim_finish` already called?\n", __func__), errno = EINVAL)
 //#define OPTIM_INVALID assert(0);  // Alternatively, just crash
@@ -23,13 +53,43 @@
 // The `assert` macro is used; but it is not required. It is OK to disable
 // It is only used to validate internal state
 
+// Recorded error; if it is `pooled`, its `text` (or `value`, for errors which aren't about a
+// message) is at offset `text` of `diag_text`
+struct optim_report {
+    struct optim_diag diag;
+    bool pooled;
+    size_t text;
+};
+
+// List of the positionals or unused args, for `optim_snapshot`
+// Its arguments are copied to `taken` before the list can be relinked by `optim_unused`
+struct optim_list {
+    uint32_t head;              // 1 + the index of the first arg, or 0
+    size_t n;
+    bool copied;
+    size_t taken;               // Offset of the arguments in `taken`, once they are copied
+};
+
 struct optim {
     size_t argc;
     char ** argv;
+    char ** argv_buf;           // Allocated to expand response files into `argv`, or to split a command string
+    bool response_files;        // Expand `@path` arguments; set by `optim_start_expand`, & kept by `optim_reset`
+    bool from_string;           // `argv` was split from `optim_start_string`, so it isn't checked for `--optim-*`
+    char * string_tail;         // Copy of the last word of the command string, if it couldn't be terminated in place
+
+    struct optim_map * maps;    // Response files (`@path`) & config files mapped into `argv` & `args`
+    size_t n_maps;
+
+    // Args from `optim_config_file` are appended after the `config_start` args from `argv`
+    size_t config_start;
+    struct optim_config_line * config_lines; // Location of each of those args
 
     struct optim_arg * args;    // List of options
-    struct optim_arg * invoc;   // Invocation
+    const char * name;          // Basename of the invocation
 
+    bool ended;                 // `optim_end` was called; its result is `end_rc`
+    int end_rc;
     bool started_options;
     bool asked_for_help;
     bool asked_for_version;
@@ -41,604 +101,4415 @@ struct optim {
     int cur_count;
     struct optim_arg * cur_arg;
 
-    char * error;               // First error message
+    struct optim_stream * stream; // More positionals, read on demand after `cur_arg`
+
+    // Subcommands, looked up by name in a trie of `struct optim_trie` nodes
+    // The arguments after the subcommand are parsed by `child`, which is kept by `optim_reset`
+    const optim_t * parent;     // Instance this is the `child` of, or NULL
+    optim_t * child;
+    size_t subcommand;          // 1 + the index in `decls` of the subcommand from `optim_get_subcommand`, or 0
+    bool started_subcommands;
+    struct optim_trie * trie;
+    size_t n_trie;
+    size_t trie_root;
+
+    // Index of `args`, built once by `optim_start`
+    // Each chain lists the matching args in argv order
+    struct optim_link * links;
+    size_t n_links;
+    uint32_t flag_heads[256];   // Chain of TYPE_FLAGS args containing each letter
+    uint32_t * long_buckets;    // Open-addressed hash of chains of TYPE_LONG(_ARG) args with the same name
+    size_t long_mask;
+
+    size_t * table_buckets;     // Open-addressed hash of the long options in an `optim_parse_table` table
+    char * flags_left;          // Letters left in each set of flags, for `optim_unused`
+
+    // Long options given as a prefix of their name are checked by `optim_end` against all
+    // the declared long options in `names`, sorted, in case the prefix is ambiguous
+    size_t n_prefixed;
+    const char ** names;        // Also used for the long options of an `optim_parse_table` table
+
+    // Index of `environ`, built by the first `optim_env` after `optim_start`
+    // Only variables starting with `env_prefix` are indexed; others are found with `getenv`
+    const char * env_prefix;
+    bool env_indexed;
+    char ** env_buckets;        // Open-addressed hash of "NAME=value" strings in `environ`
+    size_t env_mask;
+    struct optim_arg * env_arg; // Value of the current option, if it was taken from the environment
+    // Capacities (in bytes) of the buffers above, which are kept by `optim_reset`
+    size_t argv_cap;
+    size_t maps_cap;
+    size_t config_lines_cap;
+    size_t args_cap;
+    size_t links_cap;
+    size_t buckets_cap;
+    size_t table_buckets_cap;
+    size_t names_cap;
+    size_t flags_left_cap;
+    size_t trie_cap;
+    size_t env_buckets_cap;
+
+    struct optim_arena * arena; // Allocate from `arena` instead of the heap, if not NULL
+    struct optim_arena {
+        char * base;
+        size_t len;
+        size_t used;
+        size_t last;            // Offset of the last allocation, which can be grown in place
+    } arena_state;
+
+    // Errors are recorded in `diags`, & their messages are only formatted when they're printed
+    // Messages from `optim_error` are formatted into `diag_text`, since its arguments can't be kept
+    char * error;               // Static message of an error which couldn't be recorded, or NULL
+    struct optim_report * diags;
+    size_t n_diags;
+    size_t diags_cap;
+    char * diag_text;
+    size_t diag_text_len;
+    size_t diag_text_cap;
+    bool has_version;
     char * version;             // `--version` message
-    FILE * usage;               // Usage/help message buffer
-    char * usage_str;
-    size_t usage_len;
-    int usage_rc;               // Writes to `usage` are considered non-fatal
+    size_t version_cap;
+
+    // Usage/help message, only formatted if it needs to be printed
+    // If `static_text` still matches the declarations, it is printed instead of formatting
+    // `--optim-generate-c=PATH` (or `-man`) as the first argument writes it to `generate_path`
+    const struct optim_static * static_text;
+    enum {
+        GENERATE_NONE,
+        GENERATE_C,
+        GENERATE_MAN,
+    } generate;
+    const char * generate_path;
+    // `--optim-complete <cword> <words...>` parses only the words before the cursor, & `optim_end`
+    // prints the candidates for the word under it instead
+    const char * complete_word; // Word being completed, or NULL if not completing
+    const char * example_usage;
+    struct optim_decl * decls;
+    size_t n_decls;
+    size_t decls_cap;
+    char * usage_text;          // Interpolated text from `optim_usage`
+    size_t usage_text_len;
+    size_t usage_text_cap;
+
+    // Results, for `optim_snapshot`: the arguments of each option are copied to `taken` as it is declared,
+    // & the positionals & unused args are copied from their lists when they're needed
+    const char ** taken;
+    size_t n_taken;
+    size_t taken_cap;
+    struct optim_list positionals;
+    struct optim_list unused;
+
+    // Read-only view of a snapshot, from `optim_from_snapshot`, or NULL
+    // Each declaration replays the next record, & the arguments are read from its offsets in `snapshot_values`
+    const char * snapshot;
+    const struct optim_snapshot_record * snapshot_records;
+    size_t snapshot_n_records;
+    size_t snapshot_record;     // Next record to replay
+    const uint32_t * snapshot_values;
+    size_t snapshot_value;      // Next argument of the current option
+    size_t snapshot_values_end;
+
+#ifdef OPTIM_STATS
+    struct optim_stats stats;   // Counters for `optim_stats`, reset by `optim_reset`
+    int phase_depth;            // Nesting of timed calls (`optim_arg` calls `optim_flag`); only the outermost is timed
+    size_t consumer;            // Declaration now taking args, recorded in their `used_by`
+#endif
 };
 
+enum optim_type {
+    TYPE_NONE,                  // Empty
+    TYPE_INVOC,                 // Invocation; first argument
+    TYPE_BARE,                  // Does not start with "-" or is exactly "-"
+    TYPE_FLAGS,                 // Starts with just 1 '-'
+    TYPE_LONG,                  // Starts with "--" and does not have '='
+    TYPE_LONG_ARG,              // Starts with "--" and has '='
+    TYPE_SEP,                   // Exactly "--"
+};
+
+// There is one of these for each argument, so they're kept to 24 bytes (without `OPTIM_STATS`):
+// lengths, offsets & indices are 32 bits, which limits `argc` and the length of each argument to 4G
 struct optim_arg {
-    enum {
-        TYPE_NONE,              // Empty
-        TYPE_INVOC,             // Invocation; first argument
-        TYPE_BARE,              // Does not start with "-" or is exactly "-"
-        TYPE_FLAGS,             // Starts with just 1 '-'
-        TYPE_LONG,              // Starts with "--" and does not have '='
-        TYPE_LONG_ARG,          // Starts with "--" and has '='
-        TYPE_SEP,               // Exactly "--"
-    } type;
     char * arg;                 // Trimmed argument
-    char * rhs;                 // Right hand side of arguments with '='; or basename for INVOC
-    char last;                  // Last flag in a set of flags; or 0
+    uint32_t len;               // Length of `arg`, up to any '='; only for options
+    uint32_t rhs;               // Offset in `arg` of the right hand side of arguments with '=', or of
+                                // the argument of a letter in a set of flags; 0 if there isn't one
+    uint32_t next;              // 1 + the index of the next arg in the list for the same option, or 0
+    uint8_t type;               // `enum optim_type`
     bool used;                  // Has this arg been consumed yet?
-    struct optim_arg * next;    // Linked list of arguments for the same option
+    bool prefix;                // Was a long option matched by a prefix of its name? (`--verb` for `--verbose`)
+#ifdef OPTIM_STATS
+    size_t used_by;             // 1 + the index in `decls` of the declaration which used it, one of `OPTIM_BY_*`, or 0
+#endif
+};
+
+// Consumers of args without a declaration, for `used_by`
+#define OPTIM_BY_POSITIONALS SIZE_MAX
+#define OPTIM_BY_UNUSED (SIZE_MAX - 1)
+
+// Entry in the usage message: either an option declaration, or text from `optim_usage`
+struct optim_decl {
+    enum {
+        DECL_TEXT,              // `help` is text to print verbatim
+        DECL_OPTION,            // Declared with `optim_arg` or `optim_flag`
+        DECL_SUBCOMMAND,        // Declared with `optim_subcommand`; its name is `longopt`
+    } kind;
+    char opt;
+    bool pooled;                // The text is at offset `text` of `usage_text`, instead of `help`
+    size_t text;
+    const char * longopt;
+    const char * metavar;
+    const char * help;
+    const char * env;           // Environment variable from `optim_env`, or `NULL`
+    // Results of the option, for `optim_snapshot`: the number of times it was given, & its arguments
+    int count;
+    size_t taken;               // Offset of the arguments in `optim->taken`
+    size_t n_taken;
+};
+
+// Response file, mapped privately and split into arguments in place
+struct optim_map {
+    bool ok;                    // Was the file mapped? If not, `@path` is kept as an argument
+    char * addr;
+    size_t len;
+    char * tail;                // Copy of the last argument, if the file does not end in a newline
+};
+
+// Node in the trie of subcommand names; `child` & `sibling` are 1 + the index of the node, or 0
+struct optim_trie {
+    char c;
+    size_t child;
+    size_t sibling;
+    size_t decl;                // 1 + the index in `decls` of the subcommand ending at this node, or 0
+};
+
+// Location of an arg from a config file, for error messages
+struct optim_config_line {
+    const char * path;
+    size_t line;
+};
+
+// Buffered reader of delimited positionals from `optim_positionals_stream`
+struct optim_stream {
+    int fd;
+    char delim;
+    bool eof;
+    size_t start;               // Unread data is `buf[start..end)`
+    size_t end;
+    const char * pending;       // Next positional, if it was already read by `optim_get_count`
+    bool active;                // The buffer is kept by `optim_reset`, but not the stream
+    char buf[OPTIM_STREAM_BUFFER_SIZE];
+};
+
+// Entry in one of the index chains; `next` is 1 + the index of the next link, or 0
+// A set of flags has one link per distinct letter, which counts the uses of that letter left;
+// its links are consecutive, and all the links are in descending order of `arg`
+struct optim_link {
+    uint32_t arg;
+    uint32_t next;
+    uint32_t pos;               // Position of the first `c` in the set of flags
+    uint32_t count;             // Occurrences of `c` which haven't been used yet
+    char c;                     // Letter in a set of flags
+};
+
+// Snapshot from `optim_snapshot`: the header, `n_records` records, `n_values` offsets of the
+// arguments, then the strings. Offsets are from the start of the snapshot, so it can be mapped anywhere
+#define OPTIM_SNAPSHOT_MAGIC "OPTIMSNP"
+#define OPTIM_SNAPSHOT_VERSION 1
+
+struct optim_snapshot_header {
+    char magic[8];              // `OPTIM_SNAPSHOT_MAGIC`
+    uint32_t version;           // `OPTIM_SNAPSHOT_VERSION`; snapshots of other versions are rejected
+    uint32_t n_records;
+    uint32_t n_values;
+    uint32_t size;              // Of the whole snapshot, in bytes
+    uint64_t hash;              // 64-bit FNV-1a hash of everything after the header
+};
+
+// One option declaration, or the positionals or unused args
+struct optim_snapshot_record {
+    uint32_t longopt;           // Offset of the long option, or 0
+    int32_t count;
+    uint32_t values;            // The arguments are the `n_values` offsets from `values`
+    uint32_t n_values;
+    uint8_t kind;               // One of `SNAPSHOT_*`
+    char opt;
+    bool has_arg;               // Declared with `optim_arg`, rather than `optim_flag`
+};
+
+enum {
+    SNAPSHOT_OPTION,
+    SNAPSHOT_POSITIONALS,
+    SNAPSHOT_UNUSED,
+};
+
+// Iterates over the index chains for a short and a long option, merged in argv order
+struct optim_cursor {
+    size_t flag_link;
+    size_t long_link;
+    struct optim_link * link;   // Link of the last arg returned
+};
+
+// Iterates over the index chains for each prefix of a long option (`--v`, `--ve`, ...)
+struct optim_prefixes {
+    const char * longopt;
+    size_t len;                 // Length of the current prefix
+    size_t hash;                // Hash of the current prefix
+    size_t link;
 };
 
 // Backup error string, if we fail to write an error string use this instead
 static char * optim_bad_error_str = "Internal optim error: unable to write error string";
+// Error string for when the caller-supplied arena is too small
+static char * optim_arena_error_str = "Internal optim error: arena exhausted";
 
-// Find the last occurance of `x` in string `str` of size `len`
-static const char * strnrchr(const char * str, size_t len, char x) {
-    assert(str != NULL && x != '\0');
+// Allocations from an arena are aligned for any type
+union optim_align {
+    long double ld;
+    long long ll;
+    void * ptr;
+    void (*fn)(void);
+};
+#define OPTIM_ALIGN(x) (((x) + sizeof(union optim_align) - 1) & ~(sizeof(union optim_align) - 1))
+
+// Instrumentation for `optim_stats` & `optim_debug`, which compiles to nothing without `OPTIM_STATS`
+#ifdef OPTIM_STATS
+#define OPTIM_STAT(optim, counter, n) ((optim)->stats.counter += (n))
+#define OPTIM_PHASE_START(optim) uint64_t optim_phase_ = optim_phase_start(optim)
+#define OPTIM_PHASE_END(optim, counter) optim_phase_end((optim), &(optim)->stats.counter, optim_phase_)
+#define OPTIM_CONSUMER(optim, by) ((optim)->consumer = (by))
+
+static uint64_t optim_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * UINT64_C(1000000000) + (uint64_t) ts.tv_nsec;
+}
+
+// Start timing a phase, unless it is nested in another timed call
+static uint64_t optim_phase_start(optim_t * optim) {
+    return optim->phase_depth++ == 0 ? optim_clock() : 0;
+}
+
+// Add the time since `start` to `*counter`, if this is the outermost timed call
+static void optim_phase_end(optim_t * optim, uint64_t * counter, uint64_t start) {
+    if (--optim->phase_depth == 0)
+        *counter += optim_clock() - start;
+}
+#else
+#define OPTIM_STAT(optim, counter, n) ((void) (optim), (void) (n))
+#define OPTIM_PHASE_START(optim) ((void) 0)
+#define OPTIM_PHASE_END(optim, counter) ((void) 0)
+#define OPTIM_CONSUMER(optim, by) ((void) 0)
+#endif
 
-    if (len == 0) return NULL;
-    size_t i = len;
-    while (i--) {
-        if (str[i] == x) return &str[i]; 
+// Mark `arg` as used by the declaration now taking args
+static void optim_use(optim_t * optim, struct optim_arg * arg) {
+    arg->used = true;
+#ifdef OPTIM_STATS
+    arg->used_by = optim->consumer;
+#else
+    (void) optim;
+#endif
+}
+
+// Allocate `size` zeroed bytes, either from the arena or the heap
+// Returns `NULL` if out of memory
+static void * optim_alloc(optim_t * optim, size_t size) {
+    assert(optim != NULL);
+
+    OPTIM_STAT(optim, allocations, 1);
+    struct optim_arena * arena = optim->arena;
+    if (arena == NULL)
+        return calloc(1, size);
+
+    size_t start = OPTIM_ALIGN(arena->used);
+    if (start > arena->len || size > arena->len - start) {
+        if (optim->error == NULL)
+            optim->error = optim_arena_error_str;
+        return NULL;
     }
-    return NULL;
+    arena->last = start;
+    arena->used = start + size;
+    return memset(arena->base + start, 0, size);
 }
 
-optim_t * optim_start(int argc_, char ** argv, const char * example_usage) {
-    if (argc_ < 0) return (errno = EINVAL, NULL);
-    size_t argc = (size_t) argc_;
+// Grow an allocation from `optim_alloc` from `old_size` to `size` bytes
+// The new bytes are not zeroed. Returns `NULL` if out of memory, leaving `ptr` intact
+static void * optim_realloc(optim_t * optim, void * ptr, size_t old_size, size_t size) {
+    assert(optim != NULL);
+    assert(size >= old_size);
 
-    struct optim * optim = calloc(1, sizeof *optim);
-    if (optim == NULL) return NULL;
+    struct optim_arena * arena = optim->arena;
+    if (arena == NULL) {
+        OPTIM_STAT(optim, allocations, 1);
+        return realloc(ptr, size);
+    }
+    if (ptr == NULL)
+        return optim_alloc(optim, size);
 
-    // Leave an extra arg of TYPE_NONE at the end
-    optim->args = calloc(argc + 1, sizeof *optim->args);
-    if (optim->args == NULL) return (free(optim), NULL);
+    // The most recent allocation can be extended in place
+    if ((char *) ptr == arena->base + arena->last && size <= arena->len - arena->last) {
+        arena->used = arena->last + size;
+        return ptr;
+    }
 
-    optim->usage = open_memstream(&optim->usage_str, &optim->usage_len);
-    if (optim->usage == NULL) return (free(optim->args), free(optim), NULL);
+    void * new_ptr = optim_alloc(optim, size);
+    if (new_ptr != NULL)
+        memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
+}
 
-    // Done setting up: we can't fail now
+// Release an allocation from `optim_alloc`; arena allocations are released all at once
+static void optim_free(optim_t * optim, void * ptr) {
+    if (optim->arena == NULL)
+        free(ptr);
+}
 
-    optim->argc = argc;
-    optim->argv = argv;
+// Make sure `ptr` has room for `size` bytes, given that it has room for `*cap`
+// The contents are not preserved. Returns `NULL` if out of memory
+static void * optim_reserve(optim_t * optim, void * ptr, size_t * cap, size_t size) {
+    assert(optim != NULL && cap != NULL);
 
-    optim->cur_count = -1;
+    if (ptr != NULL && size <= *cap)
+        return ptr;
 
-    // Parse the first arg (the invocation) specially
-    optim->args[0].arg = argv[0];
-    optim->args[0].type = TYPE_INVOC;
-    char * basename = strrchr(argv[0], '/');
-    if (basename == NULL)
-        optim->args[0].rhs = argv[0];
-    else
-        optim->args[0].rhs = ++basename;
-    optim->args[0].used = true;
-    optim->invoc = &optim->args[0];
+    optim_free(optim, ptr);
+    ptr = optim_alloc(optim, size);
+    *cap = ptr == NULL ? 0 : size;
+    return ptr;
+}
 
-    // Parse remaining args
-    bool found_sep = false;
-    for (size_t i = 1; i < optim->argc; i++) {
-        struct optim_arg * arg = &optim->args[i];
-        arg->arg = argv[i];
-        // It's OK if the caller deleted an argument by setting it to NULL
-        if (arg->arg == NULL || arg->arg[0] == '\0') {
-            arg->type = TYPE_NONE;
-            continue;
-        }
-        if (found_sep || arg->arg[0] != '-' || arg->arg[1] == '\0') {
-            arg->type = TYPE_BARE;
-            continue;
-        }
-        arg->arg++;
-        if (arg->arg[0] != '-') {
-            arg->type = TYPE_FLAGS;
-            arg->last = arg->arg[strlen(arg->arg)-1];
-            continue;
-        }
-        arg->arg++;
-        if (arg->arg[0] == '\0') {
-            arg->type = TYPE_SEP;
-            found_sep = true;
-            continue;
-        }
+// Format a printf-style string into `*buf` at offset `off`, growing the buffer if needed
+// Returns the length, or `-1` on error
+static int optim_vformat(optim_t * optim, char ** buf, size_t * cap, size_t off, const char * fmt, va_list args) {
+    assert(optim != NULL && buf != NULL && cap != NULL);
+    assert(off <= *cap);
 
-        arg->rhs = strchr(arg->arg, '=');
-        if (arg->rhs == arg->arg) {
-            // `argv[i]` started with "--=", treat it as a BARE
-            arg->arg = argv[i];
-            arg->type = TYPE_BARE;
-        } else if (arg->rhs != NULL) {
-            *arg->rhs++ = '\0';
-            arg->type = TYPE_LONG_ARG;
-        } else {
-            arg->type = TYPE_LONG;
-        }
-    }
+    // Usually the buffer is already big enough, and it only takes one pass
+    va_list args2;
+    va_copy(args2, args);
+    int rc = vsnprintf(*buf == NULL ? NULL : *buf + off, *cap - off, fmt, args2);
+    va_end(args2);
+    if (rc < 0) return -1;
+    if ((size_t) rc < *cap - off) return rc;
 
-    // Start constructing usage message
-    optim_usage(optim, "Usage: %s %s\n\n", optim->invoc->rhs, example_usage);
+    size_t size = 2 * *cap;
+    if (size < off + (size_t) rc + 1)
+        size = off + (size_t) rc + 1;
+    char * new_buf = optim_realloc(optim, *buf, *cap, size);
+    if (new_buf == NULL) return -1;
+    *buf = new_buf;
+    *cap = size;
 
-    return optim;
+    return vsnprintf(*buf + off, size - off, fmt, args);
 }
 
-static void optim_check_unused(optim_t * optim) {
+// Record an error, about the option `opt` & `longopt` & the argument `arg`, if they're given
+// Its message is only formatted from these fields if it is printed
+// Returns the diagnostic to fill in the rest of, or NULL if it couldn't be recorded
+static struct optim_diag * optim_report(optim_t * optim, enum optim_diag_code code, const struct optim_arg * arg, char opt, const char * longopt, const char * value) {
     assert(optim != NULL);
-    for (size_t i = 0; i < optim->argc; i++) {
-        struct optim_arg * arg = &optim->args[i];
-        if (arg->used) continue;
-        switch (arg->type) {
-        case TYPE_NONE:
-        case TYPE_INVOC:
-        case TYPE_SEP:
-            break;
-        case TYPE_BARE:
-            if (optim->takes_positionals)
-                optim_error(optim, "Unused positional argument: '%s'", arg->arg);
-            else
-                optim_error(optim, "Unused floating argument: '%s'", arg->arg);
-            break;
-        case TYPE_FLAGS:
-            assert(arg->arg != NULL && arg->arg[0] != '\0');
-            optim_error(optim, "Unused flag: '-%c'", arg->arg[0]);
-            break;
-        case TYPE_LONG:
-        case TYPE_LONG_ARG:
-            assert(arg->arg != NULL && arg->arg[0] != '\0');
-            optim_error(optim, "Unused argument: '--%s'", arg->arg);
-            break;
+
+    if (optim->n_diags == optim->diags_cap) {
+        size_t cap = optim->diags_cap == 0 ? 8 : 2 * optim->diags_cap;
+        struct optim_report * diags = optim_realloc(optim, optim->diags, optim->diags_cap * sizeof *diags, cap * sizeof *diags);
+        if (diags == NULL) {
+            // Keep the "arena exhausted" error, if that was the cause
+            if (optim->error == NULL)
+                optim->error = optim_bad_error_str;
+            return NULL;
         }
+        optim->diags = diags;
+        optim->diags_cap = cap;
     }
-}
-
-int optim_finish(optim_t ** optim_p) {
-    if (optim_p == NULL || *optim_p == NULL)
-        return (OPTIM_INVALID, -1);
 
-    optim_t * optim = *optim_p;
-    optim_check_unused(optim);
+    struct optim_report * report = &optim->diags[optim->n_diags++];
+    memset(report, 0, sizeof *report);
+    struct optim_diag * diag = &report->diag;
+    diag->code = code;
+    diag->opt = opt;
+    diag->longopt = longopt;
+    diag->value = value;
+    if (arg != NULL) {
+        assert(arg > optim->args && arg < &optim->args[optim->argc]);
+        diag->index = (size_t) (arg - optim->args);
+        if (diag->index >= optim->config_start) {
+            const struct optim_config_line * where = &optim->config_lines[diag->index - optim->config_start];
+            diag->path = where->path;
+            diag->line = where->line;
+        }
+    }
+    return diag;
+}
 
-    fflush(optim->usage);
+// Record an error with a message, like `optim_error`
+// The message has to be formatted now, since its arguments can't be kept
+static int optim_verror(optim_t * optim, enum optim_diag_code code, const char * fmt, va_list args) {
+    assert(optim != NULL);
 
-    int rc = optim->error == NULL ? 0 : -1;
-    if (optim->asked_for_help) {
-        fprintf(stdout, "%s", optim->usage_str);
-        rc = 1;
-    } else if (optim->asked_for_version) {
-        fprintf(stdout, "%s", optim->version);
-        rc = 1;
-    } else if (rc != 0) {
-        fprintf(stderr, "Error: %s\n%s", optim->error, optim->usage_str);
+    size_t off = optim->diag_text_len;
+    int rc = optim_vformat(optim, &optim->diag_text, &optim->diag_text_cap, off, fmt, args);
+    if (rc < 0) {
+        if (optim->error == NULL)
+            optim->error = optim_bad_error_str;
+        return -1;
     }
+    if (optim_report(optim, code, NULL, '\0', NULL, NULL) == NULL)
+        return -1;
+    struct optim_report * report = &optim->diags[optim->n_diags - 1];
+    report->pooled = true;
+    report->text = off;
+    optim->diag_text_len += (size_t) rc + 1;
 
-    // Cleanup!
-    if (optim->error != optim_bad_error_str)
-        free(optim->error);
-    free(optim->version);
-    fclose(optim->usage);
-    free(optim->usage_str);
-    free(optim->args);
-    free(optim);
-    // NULL-out optim to prevent calls to other methods
-    *optim_p = NULL;
+    // Delete trailing newline
+    if (rc > 0 && optim->diag_text[off + (size_t) rc - 1] == '\n')
+        optim->diag_text[off + (size_t) rc - 1] = '\0';
 
     return rc;
 }
 
-// -- Declaring Options --
-
-// Add usage message for the option
-static void optim_option_usage(optim_t * optim, char opt, const char * longopt, const char * metavar, const char * help) {
-    // Precondition validation
-    assert(optim != NULL);
-    assert(opt != '\0' || longopt != NULL);
-    // `metavar` can be null if the option does not take an argument
-    if (help == NULL)
-        help = "";
-
-    // Print section header if this is the first option
-    if (!optim->started_options) {
-        optim_usage(optim, "\nOptions:\n");
-        optim->started_options = true;
+// Record an error with a message, like `optim_error`
+// For errors which aren't about a message, the message is their `value`
+__attribute__ ((format (printf, 3, 4)))
+static void optim_text_error(optim_t * optim, enum optim_diag_code code, const char * fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    optim_verror(optim, code, fmt, args);
+    va_end(args);
+}
 
-        optim_flag(optim, 'h', "help", "Print this help message");
-        if (optim_get_count(optim) > 0)
-            optim->asked_for_help = true;
+// Report that `str`, an argument of the current option, couldn't be parsed
+static void optim_parse_error(optim_t * optim, enum optim_diag_code code, const char * str) {
+    // Positionals from a stream are overwritten by the next read, so they are copied
+    const struct optim_stream * stream = optim->stream;
+    if (stream == NULL || (uintptr_t) str < (uintptr_t) stream->buf || (uintptr_t) str >= (uintptr_t) &stream->buf[sizeof stream->buf]) {
+        optim_report(optim, code, NULL, optim->cur_opt, optim->cur_longopt, str);
+        return;
     }
+    optim_text_error(optim, code, "%s", str);
+}
 
-    static char helpbuf[OPTIM_USAGE_WIDTH_HELP+1];
-    static char padding[OPTIM_USAGE_WIDTH_ARGS+1];
-    memset(padding, ' ', OPTIM_USAGE_WIDTH_ARGS);
-    padding[OPTIM_USAGE_WIDTH_ARGS] = '\0';
+// Has there been an error?
+static bool optim_failed(const optim_t * optim) {
+    return optim->error != NULL || optim->n_diags > 0;
+}
 
-    int col = 0; // This will be incorrect if optim_usage returns -1; but that's OK for now
+// Right hand side of an arg with '=', or argument of a letter in a set of flags, or NULL
+static char * optim_rhs(const struct optim_arg * arg) {
+    return arg->rhs != 0 ? arg->arg + arg->rhs : NULL;
+}
 
-    // Indent 2 spaces
-    col += optim_usage(optim, "  ");
+#define OPTIM_HASH_INIT ((size_t) 2166136261u)
 
-    // Print short options
-    if (opt != '\0')
-        col += optim_usage(optim, "-%c", opt);
-    else
-        col += optim_usage(optim, "  ");
+// Add a character to an FNV-1a hash
+static size_t optim_hash_step(size_t hash, char c) {
+    return (hash ^ (unsigned char) c) * 16777619u;
+}
 
-    // Print comma if there is both a short & long option, otherwise metavar
-    if (opt != '\0' && longopt != NULL)
-        col += optim_usage(optim, ", ");
-    else if (opt != '\0' && longopt == NULL && metavar != NULL)
-        col += optim_usage(optim, " %s", metavar);
-    else
-        col += optim_usage(optim, "  ");
+// FNV-1a hash of a long option name
+static size_t optim_hash(const char * str) {
+    size_t hash = OPTIM_HASH_INIT;
+    while (*str != '\0')
+        hash = optim_hash_step(hash, *str++);
+    return hash;
+}
 
-    // Print long option, possibly with =metavar
-    if (longopt != NULL) {
-        col += optim_usage(optim, "--%s", longopt);
-        if (metavar != NULL)
-            col += optim_usage(optim, "=%s", metavar);
+// Find the slot in `long_buckets` for the first `len` characters of `longopt`, which hash to `hash`
+// The slot is 0 if no arg has that name
+static uint32_t * optim_long_bucket_n(optim_t * optim, const char * longopt, size_t len, size_t hash) {
+    assert(optim->long_buckets != NULL);
+
+    size_t i = hash & optim->long_mask;
+    while (optim->long_buckets[i] != 0) {
+        struct optim_arg * arg = &optim->args[optim->links[optim->long_buckets[i] - 1].arg];
+        OPTIM_STAT(optim, strcmps, 1);
+        if (arg->len == len && memcmp(arg->arg, longopt, len) == 0)
+            break;
+        i = (i + 1) & optim->long_mask;
     }
+    return &optim->long_buckets[i];
+}
 
-    // Space between option and description
-    col += optim_usage(optim, "  ");
+// Find the slot in `long_buckets` for `longopt`; the slot is 0 if no arg has that name
+static uint32_t * optim_long_bucket(optim_t * optim, const char * longopt) {
+    return optim_long_bucket_n(optim, longopt, strlen(longopt), optim_hash(longopt));
+}
 
-    // Add remaining padding
-    if (col > 0 && col < OPTIM_USAGE_WIDTH_ARGS)
-        col += optim_usage(optim, "%s", &padding[col]);
+// Build the index chains over the classified `args`
+// Returns `false` if out of memory
+static bool optim_index(optim_t * optim) {
+    assert(optim != NULL);
 
-    bool first_line = true;
-    ssize_t remaining_len = OPTIM_USAGE_WIDTH_HELP + OPTIM_USAGE_WIDTH_ARGS - col;
-    if (remaining_len < 0 || remaining_len > OPTIM_USAGE_WIDTH_HELP) {
-        optim_usage(optim, "\n");
-        first_line = false;
+    // Each long arg takes one link, and each cluster of flags takes one link per distinct letter
+    size_t n_links = 0;
+    size_t n_long = 0;
+    for (size_t i = 0; i < optim->argc; i++) {
+        struct optim_arg * arg = &optim->args[i];
+        if (arg->type == TYPE_LONG || arg->type == TYPE_LONG_ARG) {
+            n_long++;
+            n_links++;
+        } else if (arg->type == TYPE_FLAGS) {
+            n_links += arg->len;
+        }
     }
+    // Links are numbered with 32 bits
+    if (n_links >= UINT32_MAX)
+        return false;
 
-    const char * hptr = help;
-    while (*hptr != '\0') {
-        if (!first_line) {
-            optim_usage(optim, "%s  ", padding);
-            remaining_len = OPTIM_USAGE_WIDTH_HELP - 2;
-        }
-        assert(remaining_len <= OPTIM_USAGE_WIDTH_HELP);
-
-        ssize_t nlen = -1;
-        const char * newline = strchr(hptr, '\n');
-        if (newline != NULL) {
-            nlen = (newline - hptr);
-            if (nlen > remaining_len)
-                nlen = -1;
-        }
-
-        if (nlen < 0) {
-            size_t hlen = strlen(hptr);
-            if (remaining_len >= 0 && hlen > (size_t) remaining_len) {
-                hlen = (size_t) remaining_len;
-                const char * space = strnrchr(hptr, hlen, ' ');
-                if (space != NULL)
-                    nlen = (space - hptr);
+    size_t n_buckets = 1;
+    while (n_buckets < 2 * n_long)
+        n_buckets *= 2;
+
+    optim->links = optim_reserve(optim, optim->links, &optim->links_cap, (n_links + 1) * sizeof *optim->links);
+    if (optim->links == NULL) return false;
+    optim->long_buckets = optim_reserve(optim, optim->long_buckets, &optim->buckets_cap, n_buckets * sizeof *optim->long_buckets);
+    if (optim->long_buckets == NULL) return false;
+    memset(optim->long_buckets, 0, n_buckets * sizeof *optim->long_buckets);
+    memset(optim->flag_heads, 0, sizeof optim->flag_heads);
+    optim->long_mask = n_buckets - 1;
+
+    // Walk backwards & prepend, so that the chains end up in argv order
+    // Each set of flags is decoded once here: a link per letter, with its first position & count
+    size_t n = 0;
+    for (size_t i = optim->argc; i-- > 0; ) {
+        struct optim_arg * arg = &optim->args[i];
+        if (arg->type == TYPE_LONG || arg->type == TYPE_LONG_ARG) {
+            uint32_t * bucket = optim_long_bucket_n(optim, arg->arg, arg->len, optim_hash(arg->arg));
+            optim->links[n] = (struct optim_link) { .arg = (uint32_t) i, .next = *bucket };
+            *bucket = (uint32_t) ++n;
+        } else if (arg->type == TYPE_FLAGS) {
+            for (const char * c = arg->arg; *c != '\0'; c++) {
+                unsigned char x = (unsigned char) *c;
+                // Only link each arg once per letter
+                if (optim->flag_heads[x] != 0 && optim->links[optim->flag_heads[x] - 1].arg == i) {
+                    optim->links[optim->flag_heads[x] - 1].count++;
+                    continue;
+                }
+                optim->links[n] = (struct optim_link) {
+                    .arg = (uint32_t) i, .next = optim->flag_heads[x],
+                    .pos = (uint32_t) (c - arg->arg), .count = 1, .c = *c,
+                };
+                optim->flag_heads[x] = (uint32_t) ++n;
             }
         }
+    }
+    assert(n <= n_links);
+    optim->n_links = n;
 
-        if (nlen < 0 || nlen > remaining_len) {
-            // Give up trying to format
-            optim_usage(optim, "%s\n", hptr);
-            break;
-        } else {
-            assert(nlen <= remaining_len);
-            memcpy(helpbuf, hptr, (size_t) nlen);
-            helpbuf[nlen] = '\0';
-            optim_usage(optim, "%s\n", helpbuf);
-            hptr += nlen + 1;
-        }
+    return true;
+}
 
-        first_line = false;
-    }
+// Start iterating over the args indexed under `opt` or `longopt`
+static struct optim_cursor optim_cursor(optim_t * optim, char opt, const char * longopt) {
+    struct optim_cursor cursor = {0, 0, NULL};
+    if (opt != '\0')
+        cursor.flag_link = optim->flag_heads[(unsigned char) opt];
+    if (longopt != NULL)
+        cursor.long_link = *optim_long_bucket(optim, longopt);
+    return cursor;
 }
 
-// Treat `arg->arg` as a set of flags, and remove `x` if it exists
-// Return `true` if `x` was in `str`
-// Set `arg->used` if `arg->arg` is now empty
-static bool arg_flagpop(struct optim_arg * arg, char x) {
-    assert(arg != NULL);
+// Return the index of the next candidate arg from `cursor`, or 0 when done
+static size_t optim_cursor_next(optim_t * optim, struct optim_cursor * cursor) {
+    size_t * link = NULL;
+    if (cursor->flag_link == 0)
+        link = &cursor->long_link;
+    else if (cursor->long_link == 0)
+        link = &cursor->flag_link;
+    else if (optim->links[cursor->flag_link - 1].arg < optim->links[cursor->long_link - 1].arg)
+        link = &cursor->flag_link;
+    else
+        link = &cursor->long_link;
 
-    if (arg->used)
-        return false;
+    if (*link == 0)
+        return 0;
+    struct optim_link * l = &optim->links[*link - 1];
+    *link = l->next;
+    cursor->link = l;
+    OPTIM_STAT(optim, args_scanned, 1);
+    return l->arg;
+}
 
-    char * str = arg->arg;
-    assert(str != NULL);
-    assert(str[0] != '\0');
+// Find the index of the first link of the set of flags `args[i]`, by binary search
+static size_t optim_flag_links(optim_t * optim, size_t i) {
+    assert(optim->args[i].type == TYPE_FLAGS);
+    size_t lo = 0;
+    size_t hi = optim->n_links;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (optim->links[mid].arg > i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    char * last = str + strlen(str) - 1;
-    assert(last != NULL);
-    assert(last >= str);
-    do {
-        if (*str == x) {
-            *str = *last;
-            *last = '\0';
-            *(last+1) = x;
-            if (arg->arg[0] == '\0')
-                arg->used = true;
+// Find the link for the letter `x` in the set of flags `args[i]`; it must be there
+static struct optim_link * optim_flag_link(optim_t * optim, size_t i, char x) {
+    for (size_t l = optim_flag_links(optim, i); l < optim->n_links && optim->links[l].arg == i; l++) {
+        if (optim->links[l].c == x)
+            return &optim->links[l];
+    }
+    assert(false);
+    return NULL;
+}
+
+// Does the set of flags with `link` have any letters with uses left?
+static bool optim_flags_left(optim_t * optim, const struct optim_link * link) {
+    size_t i = link->arg;
+    for (size_t l = optim_flag_links(optim, i); l < optim->n_links && optim->links[l].arg == i; l++) {
+        if (optim->links[l].count > 0)
             return true;
-        }
-    } while (*str++ != '\0');
+    }
     return false;
 }
 
-void optim_arg(optim_t * optim, char opt, const char * longopt, const char * metavar, const char * help) {
-    if (optim == NULL) { OPTIM_INVALID; return; }
+// Start iterating over the args from the command line named with a prefix of `longopt`
+static struct optim_prefixes optim_prefixes(const char * longopt) {
+    return (struct optim_prefixes) { .longopt = longopt, .len = 0, .hash = OPTIM_HASH_INIT, .link = 0 };
+}
 
-    if (opt == '\0' && longopt == NULL) {
-        optim_error(optim, "Internal optim error: `%s` called without `opt` or `longopt`", __func__);
-        return;
+// Return the index of the next arg named with a shorter prefix of `longopt`, or 0 when done
+// The args are in argv order for each prefix, but not across prefixes
+static size_t optim_prefixes_next(optim_t * optim, struct optim_prefixes * prefixes) {
+    if (prefixes->longopt == NULL)
+        return 0;
+
+    while (true) {
+        while (prefixes->link == 0) {
+            // The full name isn't a prefix
+            if (prefixes->longopt[prefixes->len] == '\0' || prefixes->longopt[prefixes->len + 1] == '\0')
+                return 0;
+            prefixes->hash = optim_hash_step(prefixes->hash, prefixes->longopt[prefixes->len++]);
+            prefixes->link = *optim_long_bucket_n(optim, prefixes->longopt, prefixes->len, prefixes->hash);
+        }
+
+        struct optim_link * l = &optim->links[prefixes->link - 1];
+        prefixes->link = l->next;
+        OPTIM_STAT(optim, args_scanned, 1);
+        // Only options from the command line can be abbreviated
+        if (l->arg < optim->config_start)
+            return l->arg;
     }
-    if (optim->takes_positionals) {
-        optim_error(optim, "Internal optim error: `%s` called after `optim_positionals`", __func__);
-        return;
+}
+
+// FNV-1a hash of an environment variable name, which ends at '=' or '\0'
+static size_t optim_env_hash(const char * str) {
+    size_t hash = OPTIM_HASH_INIT;
+    while (*str != '\0' && *str != '=')
+        hash = optim_hash_step(hash, *str++);
+    return hash;
+}
+
+// Does the "NAME=value" string `env` have the name `name`?
+static bool optim_env_match(const char * env, const char * name) {
+    while (*name != '\0' && *env == *name) {
+        env++;
+        name++;
     }
-    if (optim->takes_unused) {
-        optim_error(optim, "Internal optim error: `%s` called after `optim_unused`", __func__);
-        return;
+    return *name == '\0' && *env == '=';
+}
+
+// Find the slot in `env_buckets` for `name`; the slot is NULL if the variable is not set
+static char ** optim_env_bucket(optim_t * optim, const char * name) {
+    assert(optim->env_buckets != NULL);
+
+    size_t i = optim_env_hash(name) & optim->env_mask;
+    while (optim->env_buckets[i] != NULL) {
+        OPTIM_STAT(optim, strcmps, 1);
+        if (optim_env_match(optim->env_buckets[i], name))
+            break;
+        i = (i + 1) & optim->env_mask;
     }
+    return &optim->env_buckets[i];
+}
 
-    if (metavar == NULL)
-        metavar = "ARG";
+// Index the variables in `environ` starting with `env_prefix`, in one pass
+// Returns `false` if out of memory
+static bool optim_env_index(optim_t * optim) {
+    assert(optim != NULL);
 
-    optim_option_usage(optim, opt, longopt, metavar, help);
-    optim->cur_opt = opt;
-    optim->cur_longopt = longopt;
-    optim->cur_count = 0;
-    optim->cur_arg = NULL;
+    const char * prefix = optim->env_prefix != NULL ? optim->env_prefix : "";
+    size_t prefix_len = strlen(prefix);
+    size_t n_env = 0;
+    for (char ** env = environ; env != NULL && *env != NULL; env++) {
+        if (strncmp(*env, prefix, prefix_len) == 0)
+            n_env++;
+    }
+
+    size_t n_buckets = 1;
+    while (n_buckets < 2 * n_env)
+        n_buckets *= 2;
+    optim->env_buckets = optim_reserve(optim, optim->env_buckets, &optim->env_buckets_cap, n_buckets * sizeof *optim->env_buckets);
+    if (optim->env_buckets == NULL) return false;
+    memset(optim->env_buckets, 0, n_buckets * sizeof *optim->env_buckets);
+    optim->env_mask = n_buckets - 1;
+
+    for (char ** env = environ; env != NULL && *env != NULL; env++) {
+        if (strncmp(*env, prefix, prefix_len) != 0)
+            continue;
+        // Like `getenv`, the first definition of a name wins
+        char ** bucket = optim_env_bucket(optim, *env);
+        if (*bucket == NULL)
+            *bucket = *env;
+    }
+
+    optim->env_indexed = true;
+    return true;
+}
+
+// Look up the value of the environment variable `name`, or return `NULL` if it is not set
+static char * optim_env_lookup(optim_t * optim, const char * name) {
+    assert(optim != NULL && name != NULL);
+
+    const char * prefix = optim->env_prefix != NULL ? optim->env_prefix : "";
+    if (strncmp(name, prefix, strlen(prefix)) != 0)
+        return getenv(name);
+
+    char * env = *optim_env_bucket(optim, name);
+    return env == NULL ? NULL : env + strlen(name) + 1;
+}
+
+// Map the file at `path` privately, so it can be modified in place without changing the file
+// Returns `false` if the file could not be mapped
+static bool optim_map_open(const char * path, struct optim_map * map) {
+    memset(map, 0, sizeof *map);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return (close(fd), false);
+    map->len = (size_t) st.st_size;
+    if (map->len > 0) {
+        void * addr = mmap(NULL, map->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+            return (close(fd), false);
+        map->addr = addr;
+    }
+    close(fd);
+    map->ok = true;
+    return true;
+}
+
+// Map the response file at `path`, and split it into arguments in place
+// Arguments are separated by newlines (or NULs); empty lines are skipped
+// Returns `false` if the file could not be mapped
+static bool optim_map_file(optim_t * optim, const char * path, struct optim_map * map) {
+    assert(optim != NULL && path != NULL && map != NULL);
+
+    if (!optim_map_open(path, map))
+        return false;
+    // An empty file isn't mapped, so it has no address to split
+    if (map->len == 0)
+        return true;
+
+    char * end = map->addr + map->len;
+    for (char * p = map->addr; p < end; p++) {
+        p = memchr(p, '\n', (size_t) (end - p));
+        if (p == NULL) break;
+        *p = '\0';
+        if (p > map->addr && p[-1] == '\r')
+            p[-1] = '\0';
+    }
+
+    // The last argument can't be terminated in place
+    if (map->len > 0 && end[-1] != '\0') {
+        char * last = end;
+        while (last > map->addr && last[-1] != '\0')
+            last--;
+        size_t len = (size_t) (end - last);
+        map->tail = optim_alloc(optim, len + 1);
+        if (map->tail == NULL) return false;
+        memcpy(map->tail, last, len);
+    }
+    return true;
+}
+
+// Store the arguments from a response file into `out`, if it is not NULL
+// Returns the number of arguments
+static size_t optim_map_args(const struct optim_map * map, char ** out) {
+    assert(map != NULL && map->ok);
+
+    if (map->len == 0)
+        return 0;
+    size_t n = 0;
+    char * end = map->addr + map->len;
+    char * p = map->addr;
+    while (p < end) {
+        char * z = memchr(p, '\0', (size_t) (end - p));
+        if (z == NULL) {
+            if (out != NULL) out[n] = map->tail;
+            n++;
+            break;
+        }
+        if (z > p) {
+            if (out != NULL) out[n] = p;
+            n++;
+        }
+        p = z + 1;
+    }
+    return n;
+}
+
+// Expand `@path` arguments (before any "--") into the contents of the response files
+// If `path` is not NULL, `*argv_p` is just the invocation, and the contents of `path` are appended to it
+// Returns `false` if out of memory, or if `path` could not be read
+static bool optim_expand(optim_t * optim, size_t * argc_p, char *** argv_p, const char * path) {
+    assert(optim != NULL && argc_p != NULL && argv_p != NULL);
+    size_t argc = *argc_p;
+    char ** argv = *argv_p;
+
+    // Only programs which ask for it read response files, since `@path` may be meant literally, & the
+    // file's lines are echoed back in errors. A subcommand's arguments were already expanded by its parent.
+    if (path == NULL && (!optim->response_files || optim->parent != NULL))
+        return true;
+
+    size_t n_maps = path != NULL ? 1 : 0;
+    for (size_t i = 1; i < argc && path == NULL; i++) {
+        if (argv[i] == NULL) continue;
+        if (strcmp(argv[i], "--") == 0) break;
+        if (argv[i][0] == '@' && argv[i][1] != '\0')
+            n_maps++;
+    }
+    if (n_maps == 0) return true;
+
+    optim->maps = optim_reserve(optim, optim->maps, &optim->maps_cap, n_maps * sizeof *optim->maps);
+    if (optim->maps == NULL) return false;
+
+    // Map each file, and count the arguments they expand to
+    size_t new_argc = argc;
+    if (path != NULL) {
+        if (!optim_map_file(optim, path, &optim->maps[0]))
+            return false;
+        optim->n_maps = 1;
+        new_argc += optim_map_args(&optim->maps[0], NULL);
+    } else {
+        for (size_t i = 1; optim->n_maps < n_maps; i++) {
+            if (argv[i] == NULL || argv[i][0] != '@' || argv[i][1] == '\0') continue;
+            struct optim_map * map = &optim->maps[optim->n_maps++];
+            // Like gcc, keep the argument as-is if it isn't a readable file
+            if (!optim_map_file(optim, &argv[i][1], map)) {
+                if (map->ok) return false;
+                continue;
+            }
+            new_argc += optim_map_args(map, NULL) - 1;
+        }
+    }
+
+    char ** new_argv = optim_reserve(optim, optim->argv_buf, &optim->argv_cap, (new_argc + 1) * sizeof *new_argv);
+    optim->argv_buf = new_argv;
+    if (new_argv == NULL) return false;
+
+    size_t n = 0;
+    size_t m = 0;
+    for (size_t i = 0; i < argc; i++) {
+        if (i > 0 && m < optim->n_maps && path == NULL && argv[i] != NULL && argv[i][0] == '@' && argv[i][1] != '\0') {
+            struct optim_map * map = &optim->maps[m++];
+            if (map->ok) {
+                n += optim_map_args(map, &new_argv[n]);
+                continue;
+            }
+        }
+        new_argv[n++] = argv[i];
+    }
+    if (path != NULL)
+        n += optim_map_args(&optim->maps[0], &new_argv[n]);
+    assert(n == new_argc);
+
+    new_argv[n] = NULL;
+    *argc_p = new_argc;
+    *argv_p = new_argv;
+    return true;
+}
+
+// Is `c` whitespace between the words of a command string?
+static bool optim_isspace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Split the command string `buf[0..len)` into words in place, like a shell would: words are separated by
+// whitespace, and can be quoted with '...' (literally) or "..." (where `\` only escapes `\`, `"`, `$`, `` ` `` &
+// newlines), or have any character escaped with `\`. `\` followed by a newline is removed.
+// The words are packed at the start of `buf`, each followed by a NUL, except the last one if it reaches
+// the end of `buf` without anything removed before it; then `*unterminated` is set to its offset.
+// Returns the number of words; on a quoting error, `*error` is set to a message for the byte offset `*error_pos`,
+// and only the words before it are kept
+static size_t optim_split_string(char * buf, size_t len, size_t * unterminated, const char ** error, size_t * error_pos) {
+    size_t n = 0;
+    size_t r = 0;               // Next byte to read
+    size_t w = 0;               // Next byte to write; never after `r`
+    *unterminated = SIZE_MAX;
+    *error = NULL;
+    while (true) {
+        while (r < len && optim_isspace(buf[r]))
+            r++;
+        if (r == len)
+            return n;
+
+        size_t start = w;
+        bool quoted = false;
+        while (r < len && !optim_isspace(buf[r])) {
+            if (buf[r] == '\'') {
+                const char * close = memchr(&buf[r + 1], '\'', len - r - 1);
+                if (close == NULL) {
+                    *error = "Unterminated single quote";
+                    *error_pos = r;
+                    return n;
+                }
+                size_t quote_len = (size_t) (close - &buf[r + 1]);
+                memmove(&buf[w], &buf[r + 1], quote_len);
+                w += quote_len;
+                r += quote_len + 2;
+                quoted = true;
+            } else if (buf[r] == '"') {
+                size_t open = r++;
+                while (r < len && buf[r] != '"') {
+                    if (buf[r] == '\\' && r + 1 < len) {
+                        char c = buf[r + 1];
+                        if (c == '\n') {
+                            r += 2;
+                            continue;
+                        }
+                        if (c == '\\' || c == '"' || c == '$' || c == '`')
+                            r++;
+                    }
+                    buf[w++] = buf[r++];
+                }
+                if (r == len) {
+                    *error = "Unterminated double quote";
+                    *error_pos = open;
+                    return n;
+                }
+                r++;
+                quoted = true;
+            } else if (buf[r] == '\\') {
+                if (r + 1 == len) {
+                    *error = "Trailing backslash";
+                    *error_pos = r;
+                    return n;
+                }
+                if (buf[r + 1] != '\n')
+                    buf[w++] = buf[r + 1];
+                r += 2;
+            } else {
+                buf[w++] = buf[r++];
+            }
+        }
+
+        // Only quotes make an empty word
+        if (w == start && !quoted)
+            continue;
+        // Skip the whitespace after the word, since its NUL can overwrite it
+        if (r < len)
+            r++;
+        n++;
+        if (w < len)
+            buf[w++] = '\0';
+        else
+            *unterminated = start;
+    }
+}
+
+// Unmap the response files, and free the end of the command string
+static void optim_unmap(optim_t * optim) {
+    assert(optim != NULL);
+
+    optim_free(optim, optim->string_tail);
+    optim->string_tail = NULL;
+
+    for (size_t i = 0; i < optim->n_maps; i++) {
+        struct optim_map * map = &optim->maps[i];
+        if (map->addr != NULL)
+            munmap(map->addr, map->len);
+        optim_free(optim, map->tail);
+    }
+    optim->n_maps = 0;
+}
+
+// Release everything owned by `optim`, including `optim` itself
+static void optim_destroy(optim_t * optim) {
+    assert(optim != NULL);
+
+    optim_unmap(optim);
+    if (optim->child != NULL)
+        optim_destroy(optim->child);
+    optim_free(optim, optim->trie);
+    optim_free(optim, optim->diags);
+    optim_free(optim, optim->diag_text);
+    optim_free(optim, optim->version);
+    optim_free(optim, optim->usage_text);
+    optim_free(optim, optim->decls);
+    optim_free(optim, optim->links);
+    optim_free(optim, optim->long_buckets);
+    optim_free(optim, optim->table_buckets);
+    optim_free(optim, optim->names);
+    optim_free(optim, optim->flags_left);
+    optim_free(optim, optim->env_buckets);
+    optim_free(optim, optim->env_arg);
+    optim_free(optim, optim->args);
+    optim_free(optim, optim->maps);
+    optim_free(optim, optim->config_lines);
+    optim_free(optim, optim->stream);
+    optim_free(optim, optim->argv_buf);
+    optim_free(optim, optim->taken);
+    if (optim->arena == NULL)
+        free(optim);
+}
+
+#ifdef OPTIM_SIMD_WIDTH
+// Masks of the bytes in the aligned block at `p` which are '\0', and which are '='
+static void optim_block_masks(const char * p, uint32_t * nul, uint32_t * eq) {
+#if OPTIM_SIMD_WIDTH == 32
+    __m256i v = _mm256_load_si256((const __m256i *) p);
+    *nul = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+    *eq = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('=')));
+#else
+    __m128i v = _mm_load_si128((const __m128i *) p);
+    *nul = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    *eq = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('=')));
+#endif
+}
+#endif
+
+// Find the length of `str` and its first '=' (or NULL), in one pass
+static size_t optim_scan(char * str, char ** eq) {
+    *eq = NULL;
+#ifdef OPTIM_SIMD_WIDTH
+    char * p = (char *) ((uintptr_t) str & ~(uintptr_t) (OPTIM_SIMD_WIDTH - 1));
+    uint32_t nul, equals;
+    optim_block_masks(p, &nul, &equals);
+    // Ignore the bytes before `str` in the first block
+    unsigned skip = (unsigned) (str - p);
+    nul = nul >> skip << skip;
+    equals = equals >> skip << skip;
+    while (nul == 0) {
+        if (*eq == NULL && equals != 0)
+            *eq = p + __builtin_ctz(equals);
+        p += OPTIM_SIMD_WIDTH;
+        optim_block_masks(p, &nul, &equals);
+    }
+    // Only an '=' before the end counts
+    equals &= (nul & (~nul + 1)) - 1;
+    if (*eq == NULL && equals != 0)
+        *eq = p + __builtin_ctz(equals);
+    return (size_t) (p + __builtin_ctz(nul) - str);
+#else
+    char * s = str;
+    for (; *s != '\0'; s++) {
+        if (*s == '=' && *eq == NULL)
+            *eq = s;
+    }
+    return (size_t) (s - str);
+#endif
+}
+
+// Replace `argv` with the words before the cursor, from `--optim-complete <cword> <words...>`
+// The words are the whole command line, starting with the program, & `cword` is the index of the word
+// under the cursor; it is clamped to the words, so the word is empty past the end
+static void optim_complete_words(optim_t * optim, size_t * argc, char *** argv) {
+    char ** words = &(*argv)[3];
+    size_t n_words = *argc > 3 ? *argc - 3 : 0;
+    size_t cword = 0;
+    for (const char * c = *argc > 2 && (*argv)[2] != NULL ? (*argv)[2] : ""; *c >= '0' && *c <= '9' && cword <= n_words; c++)
+        cword = 10 * cword + (size_t) (*c - '0');
+    if (n_words == 0) {
+        // Complete the first argument of the program itself
+        words = *argv;
+        n_words = 1;
+    }
+    if (cword < 1)
+        cword = 1;
+
+    optim->complete_word = cword < n_words && words[cword] != NULL ? words[cword] : "";
+    *argc = cword < n_words ? cword : n_words;
+    *argv = words;
+}
+
+// Classify & index the arguments in `argv`; shared by the `optim_start` variants
+// If `path` is not NULL, the arguments are read from that file instead
+// Returns `false` if out of memory, or if `path` could not be read
+static bool optim_init(optim_t * optim, size_t argc, char ** argv, const char * example_usage, const char * path) {
+    assert(optim != NULL);
+
+    // Check for `--optim-complete <cword> <words...>`, which is run by shell completion
+    // A subcommand is completing if its parent is, which is set once it's started
+    optim->complete_word = NULL;
+    if (path == NULL && optim->parent == NULL && !optim->from_string && argc > 1 && argv[1] != NULL && strcmp(argv[1], "--optim-complete") == 0)
+        optim_complete_words(optim, &argc, &argv);
+
+    if (!optim_expand(optim, &argc, &argv, path))
+        return false;
+    // Args are numbered with 32 bits
+    if (argc >= UINT32_MAX)
+        return false;
+
+    // Leave an extra arg of TYPE_NONE at the end
+    optim->args = optim_reserve(optim, optim->args, &optim->args_cap, (argc + 1) * sizeof *optim->args);
+    if (optim->args == NULL) return false;
+    memset(optim->args, 0, (argc + 1) * sizeof *optim->args);
+
+    optim->argc = argc;
+    optim->argv = argv;
+    optim->config_start = argc;
+    optim->n_prefixed = 0;
+
+    optim->cur_count = -1;
+
+    // Parse the first arg (the invocation) specially
+    optim->args[0].arg = argv[0];
+    optim->args[0].type = TYPE_INVOC;
+    const char * basename = strrchr(argv[0], '/');
+    optim->name = basename != NULL ? basename + 1 : argv[0];
+    optim->args[0].used = true;
+
+    // Parse remaining args
+    bool found_sep = false;
+    for (size_t i = 1; i < optim->argc; i++) {
+        struct optim_arg * arg = &optim->args[i];
+        arg->arg = argv[i];
+        // It's OK if the caller deleted an argument by setting it to NULL
+        if (arg->arg == NULL || arg->arg[0] == '\0') {
+            arg->type = TYPE_NONE;
+            continue;
+        }
+        if (found_sep || arg->arg[0] != '-' || arg->arg[1] == '\0') {
+            arg->type = TYPE_BARE;
+            continue;
+        }
+        // The length & any '=' are found in one pass, so they never need to be scanned for again
+        char * eq;
+        size_t len = optim_scan(arg->arg, &eq);
+        if (len > UINT32_MAX)
+            return false;
+        arg->len = (uint32_t) len;
+        arg->arg++;
+        arg->len--;
+        if (arg->arg[0] != '-') {
+            arg->type = TYPE_FLAGS;
+            continue;
+        }
+        arg->arg++;
+        arg->len--;
+        if (arg->arg[0] == '\0') {
+            arg->type = TYPE_SEP;
+            found_sep = true;
+            continue;
+        }
+
+        if (eq == arg->arg) {
+            // `argv[i]` started with "--=", treat it as a BARE
+            arg->arg = argv[i];
+            arg->type = TYPE_BARE;
+        } else if (eq != NULL) {
+            *eq = '\0';
+            arg->rhs = (uint32_t) (eq + 1 - arg->arg);
+            arg->len = (uint32_t) (eq - arg->arg);
+            arg->type = TYPE_LONG_ARG;
+        } else {
+            arg->type = TYPE_LONG;
+        }
+    }
+    OPTIM_STAT(optim, args_scanned, optim->argc);
+
+    // Check for `--optim-generate-c=PATH` or `--optim-generate-man=PATH`, which is run at build time
+    // Only a build of optim for the generator has it, since it writes to any path it is given
+    optim->generate = GENERATE_NONE;
+#ifdef OPTIM_GENERATE
+    if (optim->complete_word == NULL && !optim->from_string && optim->argc > 1 && optim->args[1].type == TYPE_LONG_ARG) {
+        struct optim_arg * arg = &optim->args[1];
+        if (strcmp(arg->arg, "optim-generate-c") == 0)
+            optim->generate = GENERATE_C;
+        else if (strcmp(arg->arg, "optim-generate-man") == 0)
+            optim->generate = GENERATE_MAN;
+        if (optim->generate != GENERATE_NONE) {
+            optim->generate_path = optim_rhs(arg);
+            arg->used = true;
+        }
+    }
+#endif
+
+    if (!optim_index(optim))
+        return false;
+
+    optim->example_usage = example_usage;
+
+    return true;
+}
+
+optim_t * optim_start(int argc, char ** argv, const char * example_usage) {
+    if (argc < 0) return (errno = EINVAL, NULL);
+
+    struct optim * optim = calloc(1, sizeof *optim);
+    if (optim == NULL) return NULL;
+    OPTIM_STAT(optim, allocations, 1);
+
+    OPTIM_PHASE_START(optim);
+    bool ok = optim_init(optim, (size_t) argc, argv, example_usage, NULL);
+    OPTIM_PHASE_END(optim, start_ns);
+    if (!ok)
+        return (optim_destroy(optim), NULL);
+
+    return optim;
+}
+
+optim_t * optim_start_expand(int argc, char ** argv, const char * example_usage) {
+    if (argc < 0) return (errno = EINVAL, NULL);
+
+    struct optim * optim = calloc(1, sizeof *optim);
+    if (optim == NULL) return NULL;
+    OPTIM_STAT(optim, allocations, 1);
+
+    optim->response_files = true;
+    OPTIM_PHASE_START(optim);
+    bool ok = optim_init(optim, (size_t) argc, argv, example_usage, NULL);
+    OPTIM_PHASE_END(optim, start_ns);
+    if (!ok)
+        return (optim_destroy(optim), NULL);
+
+    return optim;
+}
+
+optim_t * optim_start_file(char * invocation, const char * path, const char * example_usage) {
+    if (invocation == NULL || path == NULL) return (errno = EINVAL, NULL);
+
+    struct optim * optim = calloc(1, sizeof *optim);
+    if (optim == NULL) return NULL;
+    OPTIM_STAT(optim, allocations, 1);
+
+    char * argv[] = {invocation, NULL};
+    OPTIM_PHASE_START(optim);
+    bool ok = optim_init(optim, 1, argv, example_usage, path);
+    OPTIM_PHASE_END(optim, start_ns);
+    if (!ok) {
+        int err = errno;
+        return (optim_destroy(optim), errno = err, NULL);
+    }
+
+    return optim;
+}
+
+optim_t * optim_start_string(char * buf, size_t len, const char * example_usage) {
+    if (buf == NULL && len > 0) return (errno = EINVAL, NULL);
+
+    struct optim * optim = calloc(1, sizeof *optim);
+    if (optim == NULL) return NULL;
+    OPTIM_STAT(optim, allocations, 1);
+
+    OPTIM_PHASE_START(optim);
+    // The string ends at the first NUL, so that the words can be found again by their NULs
+    len = len > 0 ? strnlen(buf, len) : 0;
+    size_t unterminated;
+    const char * error;
+    size_t error_pos = 0;
+    size_t argc = optim_split_string(buf, len, &unterminated, &error, &error_pos);
+
+    // The first word is the invocation; there has to be one, even if it's empty
+    static char empty_invocation[] = "";
+    optim->argv_buf = optim_reserve(optim, optim->argv_buf, &optim->argv_cap, (argc + 2) * sizeof *optim->argv_buf);
+    if (unterminated != SIZE_MAX) {
+        optim->string_tail = optim_alloc(optim, len - unterminated + 1);
+        if (optim->string_tail != NULL)
+            memcpy(optim->string_tail, &buf[unterminated], len - unterminated);
+    }
+    if (optim->argv_buf == NULL || (unterminated != SIZE_MAX && optim->string_tail == NULL))
+        return (optim_destroy(optim), errno = ENOMEM, NULL);
+
+    char ** argv = optim->argv_buf;
+    char * word = buf;
+    for (size_t i = 0; i < argc; i++) {
+        if (i == argc - 1 && unterminated != SIZE_MAX) {
+            argv[i] = optim->string_tail;
+            break;
+        }
+        argv[i] = word;
+        word += strlen(word) + 1;
+    }
+    if (argc == 0)
+        argv[argc++] = empty_invocation;
+    argv[argc] = NULL;
+
+    optim->from_string = true;
+    bool ok = optim_init(optim, argc, argv, example_usage, NULL);
+    OPTIM_PHASE_END(optim, start_ns);
+    if (!ok)
+        return (optim_destroy(optim), errno = ENOMEM, NULL);
+
+    if (error != NULL)
+        optim_text_error(optim, OPTIM_DIAG_QUOTING, "%s at byte %zu", error, error_pos);
+    return optim;
+}
+
+// Create an empty instance at the (aligned) start of the arena `buf`
+// Returns `NULL` if `buf` is too small
+static optim_t * optim_new_arena(void * buf, size_t buflen) {
+    size_t skip = OPTIM_ALIGN((uintptr_t) buf) - (uintptr_t) buf;
+    if (buflen < skip || buflen - skip < sizeof(struct optim))
+        return NULL;
+
+    struct optim * optim = memset((char *) buf + skip, 0, sizeof *optim);
+    optim->arena = &optim->arena_state;
+    optim->arena->base = (char *) optim;
+    optim->arena->len = buflen - skip;
+    optim->arena->used = sizeof *optim;
+    return optim;
+}
+
+optim_t * optim_start_arena(int argc, char ** argv, const char * example_usage, void * buf, size_t buflen) {
+    if (argc < 0 || buf == NULL) return (errno = EINVAL, NULL);
+
+    // The instance itself goes at the start of the arena
+    struct optim * optim = optim_new_arena(buf, buflen);
+    if (optim == NULL)
+        return (errno = ENOMEM, NULL);
+
+    OPTIM_PHASE_START(optim);
+    bool ok = optim_init(optim, (size_t) argc, argv, example_usage, NULL);
+    OPTIM_PHASE_END(optim, start_ns);
+    if (!ok)
+        return (optim_destroy(optim), errno = ENOMEM, NULL);
+
+    return optim;
+}
+
+// Forget everything from the last parse, but keep the buffers
+static void optim_clear(optim_t * optim) {
+    assert(optim != NULL);
+
+    optim_unmap(optim);
+    optim->from_string = false;
+    optim->ended = false;
+    optim->end_rc = 0;
+    optim->started_options = false;
+    optim->started_subcommands = false;
+    optim->subcommand = 0;
+    optim->n_trie = 0;
+    optim->trie_root = 0;
+    optim->asked_for_help = false;
+    optim->asked_for_version = false;
+    optim->takes_positionals = false;
+    optim->takes_unused = false;
+    optim->cur_opt = '\0';
+    optim->cur_longopt = NULL;
+    optim->cur_arg = NULL;
+    if (optim->stream != NULL)
+        optim->stream->active = false;
+    optim->error = NULL;
+    optim->n_diags = 0;
+    optim->diag_text_len = 0;
+    optim->has_version = false;
+    optim->env_indexed = false;
+    optim->n_decls = 0;
+    optim->usage_text_len = 0;
+    optim->n_taken = 0;
+    memset(&optim->positionals, 0, sizeof optim->positionals);
+    memset(&optim->unused, 0, sizeof optim->unused);
+#ifdef OPTIM_STATS
+    memset(&optim->stats, 0, sizeof optim->stats);
+    optim->phase_depth = 0;
+    optim->consumer = 0;
+#endif
+}
+
+int optim_reset(optim_t * optim, int argc, char ** argv) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, -1);
+    if (argc < 0 || optim->snapshot != NULL)
+        return (errno = EINVAL, -1);
+
+    optim_clear(optim);
+    OPTIM_PHASE_START(optim);
+    bool ok = optim_init(optim, (size_t) argc, argv, optim->example_usage, NULL);
+    OPTIM_PHASE_END(optim, start_ns);
+    if (!ok) {
+        // Leave `optim` in a valid state, with no arguments
+        optim->argc = 0;
+        if (optim->error == NULL)
+            optim->error = optim_bad_error_str;
+        return (errno = ENOMEM, -1);
+    }
+
+    return 0;
+}
+
+// Is `c` whitespace within a line of a config file?
+static bool optim_isblank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parse a boolean value from a config file
+// Returns `1` for true, `0` for false, or `-1` if it isn't a boolean
+static int optim_parse_bool(const char * str) {
+    static const char * const values[] = {"0", "false", "no", "off", "1", "true", "yes", "on"};
+    for (size_t i = 0; i < sizeof values / sizeof *values; i++) {
+        if (strcmp(str, values[i]) == 0)
+            return i >= 4;
+    }
+    return -1;
+}
+
+// Split a line of a config file in place into a TYPE_LONG(_ARG) arg
+// Returns `false` if the line is blank, a comment, or a section header
+static bool optim_config_line(char * line, char * eol, struct optim_arg * arg) {
+    while (line < eol && optim_isblank(*line))
+        line++;
+    while (eol > line && optim_isblank(eol[-1]))
+        eol--;
+    *eol = '\0';
+    // Lines of 4GB or more can't be offsets in an arg, so they're skipped
+    if (line == eol || line[0] == '#' || line[0] == ';' || line[0] == '[' || (size_t) (eol - line) > UINT32_MAX)
+        return false;
+
+    arg->arg = line;
+    arg->used = false;
+    char * eq = memchr(line, '=', (size_t) (eol - line));
+    if (eq == NULL) {
+        arg->type = TYPE_LONG;
+        arg->rhs = 0;
+        arg->len = (uint32_t) (eol - line);
+        return true;
+    }
+
+    char * rhs = eq + 1;
+    while (eq > line && optim_isblank(eq[-1]))
+        eq--;
+    *eq = '\0';
+    arg->len = (uint32_t) (eq - line);
+    while (rhs < eol && optim_isblank(*rhs))
+        rhs++;
+    // Strip matching quotes around the value
+    if (eol - rhs >= 2 && (rhs[0] == '"' || rhs[0] == '\'') && eol[-1] == rhs[0]) {
+        rhs++;
+        *--eol = '\0';
+    }
+    arg->type = TYPE_LONG_ARG;
+    arg->rhs = (uint32_t) (rhs - line);
+    return true;
+}
+
+int optim_config_file(optim_t * optim, const char * path) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, -1);
+    if (path == NULL)
+        return (errno = EINVAL, -1);
+
+    if (optim->cur_count >= 0) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called after declaring options", __func__);
+        return (errno = EINVAL, -1);
+    }
+    // The snapshot already has the options from the file, & completion doesn't need them
+    if (optim->snapshot != NULL || optim->complete_word != NULL)
+        return 0;
+
+    // The file is unmapped along with the response files
+    if ((optim->n_maps + 1) * sizeof *optim->maps > optim->maps_cap) {
+        size_t cap = 2 * (optim->n_maps + 1) * sizeof *optim->maps;
+        struct optim_map * maps = optim_realloc(optim, optim->maps, optim->maps_cap, cap);
+        if (maps == NULL) return (errno = ENOMEM, -1);
+        optim->maps = maps;
+        optim->maps_cap = cap;
+    }
+    struct optim_map * map = &optim->maps[optim->n_maps];
+    if (!optim_map_open(path, map))
+        return -1;
+    optim->n_maps++;
+    // An empty file has no options, and isn't mapped
+    if (map->len == 0)
+        return 0;
+
+    // Make room for one arg per line
+    char * end = map->addr + map->len;
+    size_t n_lines = 1;
+    for (char * p = map->addr; (p = memchr(p, '\n', (size_t) (end - p))) != NULL; p++)
+        n_lines++;
+
+    size_t argc = optim->argc + n_lines;
+    size_t n_config = argc - optim->config_start;
+    if ((argc + 1) * sizeof *optim->args > optim->args_cap) {
+        struct optim_arg * args = optim_realloc(optim, optim->args, optim->args_cap, (argc + 1) * sizeof *args);
+        if (args == NULL) return (errno = ENOMEM, -1);
+        optim->args = args;
+        optim->args_cap = (argc + 1) * sizeof *args;
+    }
+    memset(&optim->args[optim->argc], 0, (n_lines + 1) * sizeof *optim->args);
+    if (n_config * sizeof *optim->config_lines > optim->config_lines_cap) {
+        size_t cap = 2 * n_config * sizeof *optim->config_lines;
+        struct optim_config_line * lines = optim_realloc(optim, optim->config_lines, optim->config_lines_cap, cap);
+        if (lines == NULL) return (errno = ENOMEM, -1);
+        optim->config_lines = lines;
+        optim->config_lines_cap = cap;
+    }
+
+    int rc = 0;
+    size_t n = optim->argc;
+    char * next = NULL;
+    size_t line = 1;
+    for (char * p = map->addr; p < end; p = next, line++) {
+        char * eol = memchr(p, '\n', (size_t) (end - p));
+        if (eol != NULL) {
+            next = eol + 1;
+        } else {
+            // The last line can't be terminated in place
+            size_t len = (size_t) (end - p);
+            map->tail = optim_alloc(optim, len + 1);
+            if (map->tail == NULL) return (errno = ENOMEM, -1);
+            memcpy(map->tail, p, len);
+            next = end;
+            p = map->tail;
+            eol = p + len;
+        }
+
+        struct optim_arg * arg = &optim->args[n];
+        if (!optim_config_line(p, eol, arg))
+            continue;
+        if (arg->arg[0] == '\0') {
+            struct optim_diag * diag = optim_report(optim, OPTIM_DIAG_CONFIG_SYNTAX, NULL, '\0', NULL, NULL);
+            if (diag != NULL) {
+                diag->path = path;
+                diag->line = line;
+            }
+            rc = (errno = EINVAL, -1);
+            continue;
+        }
+        optim->config_lines[n - optim->config_start] = (struct optim_config_line) { .path = path, .line = line };
+        n++;
+    }
+    memset(&optim->args[n], 0, sizeof *optim->args);
+    optim->argc = n;
+
+    if (!optim_index(optim))
+        return (errno = ENOMEM, -1);
+    return rc;
+}
+
+// Number of columns taken by the `len` bytes at `str`
+// Each UTF-8 code point takes one column, so only the leading bytes are counted
+static size_t optim_columns(const char * str, size_t len) {
+    size_t cols = 0;
+    for (size_t i = 0; i < len; i++)
+        cols += ((unsigned char) str[i] & 0xC0) != 0x80;
+    return cols;
+}
+
+// Find the next line of `text` which fits in `width` columns, in one pass
+// The line ends at a newline, at the last space before it would overflow, or mid-word if there isn't one
+// Returns the length of the line in bytes; `*next` is set to the start of the following line
+static size_t optim_wrap(const char * text, size_t width, const char ** next) {
+    const char * space = NULL;
+    const char * p = text;
+    size_t cols = 0;
+    for (; *p != '\0' && *p != '\n'; p++) {
+        if (((unsigned char) *p & 0xC0) == 0x80)
+            continue;
+        if (cols == width && p > text)
+            break;
+        if (*p == ' ')
+            space = p;
+        cols++;
+    }
+
+    if (*p == '\0' || *p == '\n') {
+        *next = *p == '\n' ? p + 1 : p;
+    } else if (*p == ' ') {
+        *next = p + 1;
+    } else if (space != NULL) {
+        p = space;
+        *next = p + 1;
+    } else {
+        *next = p;
+    }
+    return (size_t) (p - text);
+}
+
+// Width of the terminal `out` is printed to, from `TIOCGWINSZ` or `$COLUMNS`; otherwise 80 columns
+static size_t optim_usage_width(const optim_t * optim, FILE * out) {
+    size_t width = OPTIM_USAGE_WIDTH_ARGS + OPTIM_USAGE_WIDTH_HELP;
+    // Generated text is the same wherever it was generated
+    if (optim->generate != GENERATE_NONE)
+        return width;
+
+    struct winsize ws;
+    if (ioctl(fileno(out), TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        return ws.ws_col;
+
+    const char * columns = getenv("COLUMNS");
+    if (columns != NULL && columns[0] >= '0' && columns[0] <= '9') {
+        char * end = NULL;
+        unsigned long x = strtoul(columns, &end, 10);
+        if (*end == '\0' && x > 0)
+            width = (size_t) x;
+    }
+    return width;
+}
+
+// Format the usage message for an option, wrapping the help to `width` columns
+// Returns the number of bytes written
+static size_t optim_print_option(FILE * out, const struct optim_decl * decl, size_t width) {
+    assert(out != NULL && decl != NULL);
+    assert(decl->kind == DECL_OPTION || decl->kind == DECL_SUBCOMMAND);
+
+    char opt = decl->opt;
+    const char * longopt = decl->longopt;
+    // `metavar` can be null if the option does not take an argument
+    const char * metavar = decl->metavar;
+    const char * help = decl->help;
+    if (help == NULL)
+        help = "";
+
+    int col = 0; // This will be incorrect if fprintf returns -1; but that's OK for now
+    int wide = 0; // Bytes of multi-byte characters in `col` which don't take a column
+
+    // Indent 2 spaces
+    col += fprintf(out, "  ");
+
+    if (decl->kind == DECL_SUBCOMMAND) {
+        // Print just the name of subcommands
+        col += fprintf(out, "%s", longopt);
+        wide += (int) (strlen(longopt) - optim_columns(longopt, strlen(longopt)));
+    } else {
+        // Print short options
+        if (opt != '\0')
+            col += fprintf(out, "-%c", opt);
+        else
+            col += fprintf(out, "  ");
+
+        // Print comma if there is both a short & long option, otherwise metavar
+        if (opt != '\0' && longopt != NULL)
+            col += fprintf(out, ", ");
+        else if (opt != '\0' && longopt == NULL && metavar != NULL)
+            col += fprintf(out, " %s", metavar);
+        else
+            col += fprintf(out, "  ");
+
+        // Print long option, possibly with =metavar
+        if (longopt != NULL) {
+            col += fprintf(out, "--%s", longopt);
+            wide += (int) (strlen(longopt) - optim_columns(longopt, strlen(longopt)));
+            if (metavar != NULL)
+                col += fprintf(out, "=%s", metavar);
+        }
+        if (metavar != NULL)
+            wide += (int) (strlen(metavar) - optim_columns(metavar, strlen(metavar)));
+    }
+
+    // Space between option and description
+    col += fprintf(out, "  ");
+
+    // Add remaining padding
+    int bytes = col;
+    col -= wide;
+    if (col > 0 && col < OPTIM_USAGE_WIDTH_ARGS) {
+        bytes += fprintf(out, "%*s", OPTIM_USAGE_WIDTH_ARGS - col, "");
+        col = OPTIM_USAGE_WIDTH_ARGS;
+    }
+
+    // The help is in a column after the options, and starts on the same line if there's room
+    size_t help_width = OPTIM_USAGE_MIN_HELP;
+    if (width > OPTIM_USAGE_WIDTH_ARGS + OPTIM_USAGE_MIN_HELP)
+        help_width = width - OPTIM_USAGE_WIDTH_ARGS;
+    size_t remaining = 0;
+    if (col > 0 && (size_t) col < OPTIM_USAGE_WIDTH_ARGS + help_width)
+        remaining = OPTIM_USAGE_WIDTH_ARGS + help_width - (size_t) col;
+
+    int len = 0; // Bytes written after the padding
+    bool first_line = true;
+    if (remaining == 0) {
+        len += fprintf(out, "\n");
+        first_line = false;
+    }
+
+    const char * text = help;
+    while (*text != '\0') {
+        if (!first_line) {
+            len += fprintf(out, "%*s  ", OPTIM_USAGE_WIDTH_ARGS, "");
+            remaining = help_width - 2;
+        }
+
+        const char * next = NULL;
+        size_t n = optim_wrap(text, remaining, &next);
+        len += (int) fwrite(text, 1, n, out);
+        len += fprintf(out, "\n");
+        text = next;
+        first_line = false;
+    }
+
+    if (decl->env != NULL) {
+        // Start a new line, unless the help was empty & the line is still open
+        if (!first_line)
+            len += fprintf(out, "%*s  ", OPTIM_USAGE_WIDTH_ARGS, "");
+        len += fprintf(out, "[env: %s]\n", decl->env);
+    } else if (first_line) {
+        len += fprintf(out, "\n");
+    }
+
+    len += bytes;
+    return len > 0 ? (size_t) len : 0;
+}
+
+// Format the whole usage message
+static void optim_print_usage(optim_t * optim, FILE * out) {
+    assert(optim != NULL && out != NULL);
+
+    int rc = 0;
+    if (optim->parent != NULL)
+        rc = fprintf(out, "Usage: %s %s %s\n\n", optim->parent->name, optim->name, optim->example_usage);
+    else
+        rc = fprintf(out, "Usage: %s %s\n\n", optim->name, optim->example_usage);
+    size_t len = rc > 0 ? (size_t) rc : 0;
+    size_t width = optim_usage_width(optim, out);
+    for (size_t i = 0; i < optim->n_decls; i++) {
+        const struct optim_decl * decl = &optim->decls[i];
+        const char * text = NULL;
+        switch (decl->kind) {
+        case DECL_TEXT:
+            text = decl->pooled ? &optim->usage_text[decl->text] : decl->help;
+            fputs(text, out);
+            len += strlen(text);
+            break;
+        case DECL_OPTION:
+        case DECL_SUBCOMMAND:
+            len += optim_print_option(out, decl, width);
+            break;
+        }
+    }
+    OPTIM_STAT(optim, usage_bytes, len);
+}
+
+#define OPTIM_HASH64_INIT UINT64_C(14695981039346656037)
+
+// Add `len` bytes at `buf` to a 64-bit FNV-1a hash
+static uint64_t optim_hash64(uint64_t hash, const void * buf, size_t len) {
+    const unsigned char * bytes = buf;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * UINT64_C(1099511628211);
+    return hash;
+}
+
+// Add a string (or `NULL`) to a 64-bit FNV-1a hash, including its terminator
+static uint64_t optim_hash64_str(uint64_t hash, const char * str) {
+    if (str == NULL)
+        return optim_hash64(hash, "\xff", 1);
+    return optim_hash64(hash, str, strlen(str) + 1);
+}
+
+// Hash everything which goes into the usage & version messages
+// Text from `optim_static` is only used if it was generated with the same hash
+static uint64_t optim_text_hash(const optim_t * optim) {
+    uint64_t hash = OPTIM_HASH64_INIT;
+    hash = optim_hash64_str(hash, optim->parent != NULL ? optim->parent->name : NULL);
+    hash = optim_hash64_str(hash, optim->name);
+    hash = optim_hash64_str(hash, optim->example_usage);
+    hash = optim_hash64_str(hash, optim->has_version ? optim->version : NULL);
+    for (size_t i = 0; i < optim->n_decls; i++) {
+        const struct optim_decl * decl = &optim->decls[i];
+        char head[2] = { (char) decl->kind, decl->opt };
+        hash = optim_hash64(hash, head, sizeof head);
+        if (decl->kind == DECL_TEXT) {
+            hash = optim_hash64_str(hash, decl->pooled ? &optim->usage_text[decl->text] : decl->help);
+            continue;
+        }
+        hash = optim_hash64_str(hash, decl->longopt);
+        hash = optim_hash64_str(hash, decl->metavar);
+        hash = optim_hash64_str(hash, decl->help);
+        hash = optim_hash64_str(hash, decl->env);
+    }
+    return hash;
+}
+
+// Write all of `iov` to `fd`, in one call unless it is interrupted
+// Returns `false` on error
+static bool optim_writev(int fd, struct iovec * iov, int n) {
+    while (n > 0) {
+        ssize_t rc = writev(fd, iov, n);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0)
+            return false;
+        size_t done = (size_t) rc;
+        while (n > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return true;
+}
+
+// Add to the message being written by `optim_diag_message`: to `out`, or to `*buf` like `snprintf`
+// `*total` is the length so far, or `-1` after an error
+__attribute__ ((format (printf, 5, 6)))
+static void optim_diag_printf(FILE * out, char ** buf, size_t * len, int * total, const char * fmt, ...) {
+    if (*total < 0)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+    int rc = out != NULL ? vfprintf(out, fmt, args) : vsnprintf(*buf, *len, fmt, args);
+    va_end(args);
+    if (rc < 0 || rc > INT_MAX - *total) {
+        *total = -1;
+        return;
+    }
+    *total += rc;
+
+    // Leave room for the terminator
+    size_t n = *len > 0 && (size_t) rc >= *len ? *len - 1 : (size_t) rc;
+    if (out == NULL && *len > 0 && n > 0) {
+        *buf += n;
+        *len -= n;
+    }
+}
+
+// Write the message of `diag` to `out`, or to `buf` like `snprintf` if `out` is NULL
+// Returns its length, or `-1` on error
+static int optim_diag_message(const struct optim_diag * diag, FILE * out, char * buf, size_t len) {
+    int total = 0;
+    if (diag->path != NULL)
+        optim_diag_printf(out, &buf, &len, &total, "%s:%zu: ", diag->path, diag->line);
+
+    switch (diag->code) {
+    case OPTIM_DIAG_ERROR:
+    case OPTIM_DIAG_INTERNAL:
+    case OPTIM_DIAG_STREAM:
+    case OPTIM_DIAG_QUOTING:
+        optim_diag_printf(out, &buf, &len, &total, "%s", diag->text != NULL ? diag->text : "");
+        break;
+    case OPTIM_DIAG_MISSING_ARG:
+        if (diag->longopt != NULL)
+            optim_diag_printf(out, &buf, &len, &total, "Flag '--%s' is missing its argument", diag->longopt);
+        else
+            optim_diag_printf(out, &buf, &len, &total, "Flag '-%c' is missing its argument", diag->opt);
+        break;
+    case OPTIM_DIAG_UNEXPECTED_ARG:
+        optim_diag_printf(out, &buf, &len, &total, "Flag '--%s' does not take an argument", diag->longopt);
+        break;
+    case OPTIM_DIAG_NOT_BOOL:
+        optim_diag_printf(out, &buf, &len, &total, "Flag '--%s' takes a boolean, not '%s'", diag->longopt, diag->value);
+        break;
+    case OPTIM_DIAG_AMBIGUOUS:
+        optim_diag_printf(out, &buf, &len, &total, "Option '--%s' is ambiguous; it could be '--%s' or '--%s'", diag->value, diag->longopt, diag->alt);
+        break;
+    case OPTIM_DIAG_UNUSED_POSITIONAL:
+        optim_diag_printf(out, &buf, &len, &total, "Unused positional argument: '%s'", diag->value);
+        break;
+    case OPTIM_DIAG_UNUSED_FLOATING:
+        optim_diag_printf(out, &buf, &len, &total, "Unused floating argument: '%s'", diag->value);
+        break;
+    case OPTIM_DIAG_UNUSED_FLAG:
+        optim_diag_printf(out, &buf, &len, &total, "Unused flag: '-%c'", diag->opt);
+        break;
+    case OPTIM_DIAG_UNUSED_OPTION:
+        optim_diag_printf(out, &buf, &len, &total, "Unused argument: '--%s'", diag->longopt);
+        break;
+    case OPTIM_DIAG_BAD_NUMBER:
+        optim_diag_printf(out, &buf, &len, &total, "Unable to parse number '%s'", diag->value);
+        break;
+    case OPTIM_DIAG_BAD_SIZE:
+        optim_diag_printf(out, &buf, &len, &total, "Unable to parse size '%s'", diag->value);
+        break;
+    case OPTIM_DIAG_BAD_DURATION:
+        optim_diag_printf(out, &buf, &len, &total, "Unable to parse duration '%s'", diag->value);
+        break;
+    case OPTIM_DIAG_UNKNOWN_COMMAND:
+        optim_diag_printf(out, &buf, &len, &total, "Unknown command: '%s'", diag->value);
+        break;
+    case OPTIM_DIAG_CONFIG_SYNTAX:
+        optim_diag_printf(out, &buf, &len, &total, "Expected 'name = value'");
+        break;
+    case OPTIM_DIAG_TAKEN_ARG:
+        optim_diag_printf(out, &buf, &len, &total, "Flag '-%c' takes an argument, but '%s' was read as flags; write '-%c %s'",
+            diag->opt, diag->value, diag->opt, diag->value);
+        break;
+    }
+    return total;
+}
+
+// Print every error, one per line
+static void optim_print_errors(optim_t * optim, FILE * out) {
+    size_t iter = 0;
+    const struct optim_diag * diag;
+    while ((diag = optim_next_diag(optim, &iter)) != NULL) {
+        fputs("Error: ", out);
+        optim_diag_message(diag, out, NULL, 0);
+        fputc('\n', out);
+    }
+    if (optim->error != NULL)
+        fprintf(out, "Error: %s\n", optim->error);
+}
+
+// Print the errors (if `errors` is set) & the usage message, from `static_text` if it is up to date
+// Format the errors into `buf` (of `len` bytes) as `optim_print_errors` prints them, like `snprintf`
+// Returns the length of all of them, or -1 on error
+static int optim_format_errors(optim_t * optim, char * buf, size_t len) {
+    int total = 0;
+    size_t iter = 0;
+    const struct optim_diag * diag;
+    while ((diag = optim_next_diag(optim, &iter)) != NULL && total >= 0) {
+        optim_diag_printf(NULL, &buf, &len, &total, "Error: ");
+        int rc = optim_diag_message(diag, NULL, buf, len);
+        if (total < 0 || rc < 0 || rc > INT_MAX - total)
+            return -1;
+        total += rc;
+        size_t n = len > 0 && (size_t) rc >= len ? len - 1 : (size_t) rc;
+        if (len > 0) {
+            buf += n;
+            len -= n;
+        }
+        optim_diag_printf(NULL, &buf, &len, &total, "\n");
+    }
+    if (optim->error != NULL)
+        optim_diag_printf(NULL, &buf, &len, &total, "Error: %s\n", optim->error);
+    return total;
+}
+
+static void optim_emit_usage(optim_t * optim, FILE * out, bool errors) {
+    const struct optim_static * text = optim->static_text;
+    if (text == NULL || text->usage == NULL || text->hash != optim_text_hash(optim)) {
+        if (errors)
+            optim_print_errors(optim, out);
+        optim_print_usage(optim, out);
+        return;
+    }
+
+    // The errors are formatted into a buffer, so that they go out with the usage in one `writev`
+    // If it can't be allocated, they're printed with stdio first
+    struct iovec iov[2];
+    int n = 0;
+    int len = errors ? optim_format_errors(optim, NULL, 0) : 0;
+    char * buf = len > 0 ? optim_alloc(optim, (size_t) len + 1) : NULL;
+    if (buf != NULL) {
+        optim_format_errors(optim, buf, (size_t) len + 1);
+        iov[n++] = (struct iovec) { .iov_base = buf, .iov_len = (size_t) len };
+    } else if (errors) {
+        optim_print_errors(optim, out);
+    }
+
+    // Keep the order of anything already printed with stdio
+    fflush(stdout);
+    fflush(stderr);
+    iov[n++] = (struct iovec) { .iov_base = (char *) text->usage, .iov_len = text->usage_len };
+    optim_writev(fileno(out), iov, n);
+    OPTIM_STAT(optim, usage_bytes, text->usage_len);
+    optim_free(optim, buf);
+}
+
+#ifdef OPTIM_GENERATE
+// Write the name of the program (& its subcommand) for the generated files, with `sep` between them
+// Characters which aren't valid in a C identifier are replaced with '_' if `ident` is set
+static void optim_write_name(const optim_t * optim, FILE * out, char sep, bool ident) {
+    const char * names[2] = { optim->parent != NULL ? optim->parent->name : NULL, optim->name };
+    for (size_t i = 0; i < 2; i++) {
+        if (names[i] == NULL) continue;
+        if (i > 0 && names[0] != NULL)
+            fputc(sep, out);
+        for (const char * c = names[i]; *c != '\0'; c++) {
+            bool alnum = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9');
+            fputc(!ident || alnum ? *c : '_', out);
+        }
+    }
+}
+
+// Write `len` bytes at `str` as a C string literal, split after each newline
+static void optim_write_c_string(FILE * out, const char * str, size_t len) {
+    fprintf(out, "\n        \"");
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) str[i];
+        if (c == '\n' && i + 1 < len)
+            fprintf(out, "\\n\"\n        \"");
+        else if (c == '\n')
+            fprintf(out, "\\n");
+        else if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < ' ' || c >= 0x7f)
+            fprintf(out, "\\%03o", c);
+        else
+            fputc(c, out);
+    }
+    fprintf(out, "\"");
+}
+
+// Write `str` in a C comment, escaping anything which could end it or continue it onto the next line
+static void optim_write_c_comment(FILE * out, const char * str) {
+    for (const char * c = str; *c != '\0'; c++) {
+        unsigned char x = (unsigned char) *c;
+        if (x == '\\')
+            fprintf(out, "\\\\");
+        else if (x == '*' && c[1] == '/')
+            fprintf(out, "*\\");
+        else if (x < ' ' || x >= 0x7f)
+            fprintf(out, "\\%03o", x);
+        else
+            fputc(x, out);
+    }
+}
+
+// Write a C source file defining the formatted usage & version messages, for `optim_static`
+// Returns `false` on error
+static bool optim_write_c(optim_t * optim, FILE * out) {
+    char * usage = NULL;
+    size_t usage_len = 0;
+    FILE * mem = open_memstream(&usage, &usage_len);
+    if (mem == NULL)
+        return false;
+    optim_print_usage(optim, mem);
+    if (fclose(mem) != 0)
+        return (free(usage), false);
+
+    fprintf(out, "// Generated by `");
+    optim_write_name(optim, out, ' ', false);
+    fprintf(out, " --optim-generate-c=");
+    optim_write_c_comment(out, optim->generate_path);
+    fprintf(out, "`; do not edit\n");
+    fprintf(out, "// optim only uses this text while the declarations still match `hash`\n\n");
+    fprintf(out, "#include \"optim.h\"\n\n");
+    fprintf(out, "const struct optim_static optim_static_");
+    optim_write_name(optim, out, '_', true);
+    fprintf(out, " = {\n");
+    fprintf(out, "    .hash = UINT64_C(0x%016llx),\n", (unsigned long long) optim_text_hash(optim));
+    fprintf(out, "    .usage =");
+    optim_write_c_string(out, usage, usage_len);
+    fprintf(out, ",\n    .usage_len = %zu,\n", usage_len);
+    if (optim->has_version) {
+        size_t version_len = strlen(optim->version);
+        fprintf(out, "    .version =");
+        optim_write_c_string(out, optim->version, version_len);
+        fprintf(out, ",\n    .version_len = %zu,\n", version_len);
+    }
+    fprintf(out, "};\n");
+
+    free(usage);
+    return ferror(out) == 0;
+}
+
+// Write `len` bytes at `str` as roff text, escaping '-', '\\', '"', & control characters at the start
+// It can also be written inside the quotes of a macro's argument
+static void optim_write_roff(FILE * out, const char * str, size_t len) {
+    if (len > 0 && (str[0] == '.' || str[0] == '\''))
+        fprintf(out, "\\&");
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] == '-')
+            fprintf(out, "\\-");
+        else if (str[i] == '\\')
+            fprintf(out, "\\e");
+        else if (str[i] == '"')
+            fprintf(out, "\\(dq");
+        else
+            fputc(str[i], out);
+    }
+}
+
+// Write the lines of `text` as roff, with a line break between them
+static void optim_write_roff_lines(FILE * out, const char * text) {
+    while (*text != '\0') {
+        size_t len = strcspn(text, "\n");
+        optim_write_roff(out, text, len);
+        text += len;
+        if (*text == '\n' && *++text != '\0')
+            fprintf(out, "\n.br");
+        fprintf(out, "\n");
+    }
+}
+
+// Write a man page like `help2man` would make from `--help` & `--version`
+// Returns `false` on error
+static bool optim_write_man(optim_t * optim, FILE * out) {
+    fprintf(out, ".\\\" Generated by `--optim-generate-man`; do not edit\n");
+    fprintf(out, ".TH \"");
+    optim_write_name(optim, out, '-', false);
+    fprintf(out, "\" 1 \"\" \"");
+    if (optim->has_version)
+        optim_write_roff(out, optim->version, strcspn(optim->version, "\n"));
+    fprintf(out, "\" \"User Commands\"\n");
+
+    // The first line of the usage text is the description
+    fprintf(out, ".SH NAME\n");
+    optim_write_name(optim, out, '-', false);
+    if (optim->n_decls > 0 && optim->decls[0].kind == DECL_TEXT) {
+        const struct optim_decl * decl = &optim->decls[0];
+        const char * text = decl->pooled ? &optim->usage_text[decl->text] : decl->help;
+        size_t len = strcspn(text, "\n");
+        if (len > 0) {
+            fprintf(out, " \\- ");
+            optim_write_roff(out, text, len);
+        }
+    }
+    fprintf(out, "\n.SH SYNOPSIS\n.B ");
+    optim_write_name(optim, out, ' ', false);
+    fprintf(out, "\n");
+    optim_write_roff(out, optim->example_usage, strlen(optim->example_usage));
+    fprintf(out, "\n.SH DESCRIPTION\n");
+
+    for (size_t i = 0; i < optim->n_decls; i++) {
+        const struct optim_decl * decl = &optim->decls[i];
+        const char * help = decl->help != NULL ? decl->help : "";
+        switch (decl->kind) {
+        case DECL_TEXT: {
+            // Blank lines start paragraphs, and lines ending in ':' are headings
+            const char * text = decl->pooled ? &optim->usage_text[decl->text] : decl->help;
+            while (*text != '\0') {
+                size_t len = strcspn(text, "\n");
+                if (len == 0) {
+                    fprintf(out, ".PP\n");
+                } else if (text[len - 1] == ':') {
+                    fprintf(out, ".SS \"");
+                    optim_write_roff(out, text, len - 1);
+                    fprintf(out, "\"\n");
+                } else {
+                    optim_write_roff(out, text, len);
+                    fprintf(out, "\n");
+                }
+                text += len;
+                if (*text == '\n')
+                    text++;
+            }
+            break;
+        }
+        case DECL_OPTION:
+            fprintf(out, ".TP\n");
+            if (decl->opt != '\0')
+                fprintf(out, "\\fB\\-%c\\fR", decl->opt);
+            if (decl->opt != '\0' && decl->longopt != NULL)
+                fprintf(out, ", ");
+            else if (decl->opt != '\0' && decl->metavar != NULL) {
+                fprintf(out, " \\fI");
+                optim_write_roff(out, decl->metavar, strlen(decl->metavar));
+                fprintf(out, "\\fR");
+            }
+            if (decl->longopt != NULL) {
+                fprintf(out, "\\fB\\-\\-");
+                optim_write_roff(out, decl->longopt, strlen(decl->longopt));
+                fprintf(out, "\\fR");
+                if (decl->metavar != NULL) {
+                    fprintf(out, "=\\fI");
+                    optim_write_roff(out, decl->metavar, strlen(decl->metavar));
+                    fprintf(out, "\\fR");
+                }
+            }
+            fprintf(out, "\n");
+            optim_write_roff_lines(out, help);
+            if (decl->env != NULL) {
+                fprintf(out, "%s[env: ", help[0] != '\0' ? ".br\n" : "");
+                optim_write_roff(out, decl->env, strlen(decl->env));
+                fprintf(out, "]\n");
+            }
+            break;
+        case DECL_SUBCOMMAND:
+            fprintf(out, ".TP\n\\fB");
+            optim_write_roff(out, decl->longopt, strlen(decl->longopt));
+            fprintf(out, "\\fR\n");
+            optim_write_roff_lines(out, help);
+            break;
+        }
+    }
+
+    return ferror(out) == 0;
+}
+
+// Write the file for `--optim-generate-c` or `--optim-generate-man`
+// Returns `false` on error, which is printed
+static bool optim_generate(optim_t * optim) {
+    assert(optim->generate != GENERATE_NONE);
+
+    FILE * out = fopen(optim->generate_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: unable to write '%s': %s\n", optim->generate_path, strerror(errno));
+        return false;
+    }
+    bool ok = optim->generate == GENERATE_C ? optim_write_c(optim, out) : optim_write_man(optim, out);
+    if (fclose(out) != 0)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "Error: unable to write '%s'\n", optim->generate_path);
+    return ok;
+}
+#endif
+
+static void optim_check_unused(optim_t * optim) {
+    assert(optim != NULL);
+    OPTIM_STAT(optim, args_scanned, optim->argc);
+    for (size_t i = 0; i < optim->argc; i++) {
+        struct optim_arg * arg = &optim->args[i];
+        if (arg->used) continue;
+        switch ((enum optim_type) arg->type) {
+        case TYPE_NONE:
+        case TYPE_INVOC:
+        case TYPE_SEP:
+            break;
+        case TYPE_BARE:
+            optim_report(optim, optim->takes_positionals ? OPTIM_DIAG_UNUSED_POSITIONAL : OPTIM_DIAG_UNUSED_FLOATING, arg, '\0', NULL, arg->arg);
+            break;
+        case TYPE_FLAGS:
+            assert(arg->arg != NULL && arg->arg[0] != '\0');
+            // The first letter which has uses left; `optim_unused` has already picked them out
+            if (optim->takes_unused) {
+                optim_report(optim, OPTIM_DIAG_UNUSED_FLAG, arg, arg->arg[1], NULL, NULL);
+                break;
+            }
+            for (const char * c = arg->arg; *c != '\0'; c++) {
+                if (optim_flag_link(optim, i, *c)->count > 0) {
+                    optim_report(optim, OPTIM_DIAG_UNUSED_FLAG, arg, *c, NULL, NULL);
+                    break;
+                }
+            }
+            break;
+        case TYPE_LONG:
+        case TYPE_LONG_ARG:
+            assert(arg->arg != NULL && arg->arg[0] != '\0');
+            optim_report(optim, OPTIM_DIAG_UNUSED_OPTION, arg, '\0', arg->arg, optim_rhs(arg));
+            break;
+        }
+    }
+}
+
+// Sort long option names with `qsort`
+static int optim_compare_names(const void * a, const void * b) {
+    return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+// Find the first name in the sorted `names` which starts with `prefix`, and the number of
+// distinct names which do (up to 2); a name which is exactly `prefix` is the only match
+static size_t optim_find_prefix(optim_t * optim, const char * const * names, size_t n, const char * prefix, size_t * count) {
+    size_t len = strlen(prefix);
+    size_t lo = 0;
+    size_t hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        OPTIM_STAT(optim, strcmps, 1);
+        if (strcmp(names[mid], prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *count = 0;
+    if (lo < n && strcmp(names[lo], prefix) == 0) {
+        *count = 1;
+        return lo;
+    }
+    for (size_t i = lo; i < n && *count < 2 && strncmp(names[i], prefix, len) == 0; i++) {
+        OPTIM_STAT(optim, strcmps, 1);
+        if (i == lo || strcmp(names[i], names[i - 1]) != 0)
+            (*count)++;
+    }
+    return lo;
+}
+
+// Report that the long option `arg` is a prefix of `names[first]` and at least one other name
+static void optim_report_ambiguous(optim_t * optim, const struct optim_arg * arg, size_t first) {
+    size_t second = first + 1;
+    while (strcmp(optim->names[second], optim->names[first]) == 0)
+        second++;
+    struct optim_diag * diag = optim_report(optim, OPTIM_DIAG_AMBIGUOUS, arg, '\0', optim->names[first], arg->arg);
+    if (diag != NULL)
+        diag->alt = optim->names[second];
+}
+
+// Report that `arg`, the whole name `longopt`, was taken as an abbreviation by an option declared before it
+// Both options have it, & the earlier one's results have already been read, so it is ambiguous
+static void optim_report_reclaimed(optim_t * optim, const struct optim_arg * arg, const char * longopt) {
+    // The first option declared with a longer name starting with `longopt` took it
+    const char * alt = longopt;
+    size_t len = strlen(longopt);
+    for (size_t i = 0; i < optim->n_decls; i++) {
+        const struct optim_decl * decl = &optim->decls[i];
+        if (decl->kind == DECL_OPTION && decl->longopt != NULL && strncmp(decl->longopt, longopt, len) == 0 && decl->longopt[len] != '\0') {
+            alt = decl->longopt;
+            break;
+        }
+    }
+    struct optim_diag * diag = optim_report(optim, OPTIM_DIAG_AMBIGUOUS, arg, '\0', longopt, arg->arg);
+    if (diag != NULL)
+        diag->alt = alt;
+}
+
+// Report abbreviated long options which are a prefix of more than one declared long option
+// Options are declared one at a time, so this can only be checked at the end
+// Returns `true` if there was an ambiguous option
+static bool optim_check_prefixes(optim_t * optim) {
+    assert(optim != NULL);
+
+    if (optim->n_prefixed == 0)
+        return false;
+
+    size_t n = 0;
+    for (size_t i = 0; i < optim->n_decls; i++) {
+        if (optim->decls[i].kind == DECL_OPTION && optim->decls[i].longopt != NULL)
+            n++;
+    }
+    optim->names = optim_reserve(optim, optim->names, &optim->names_cap, n * sizeof *optim->names);
+    if (optim->names == NULL && n > 0) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to allocate option names");
+        return false;
+    }
+    n = 0;
+    for (size_t i = 0; i < optim->n_decls; i++) {
+        if (optim->decls[i].kind == DECL_OPTION && optim->decls[i].longopt != NULL)
+            optim->names[n++] = optim->decls[i].longopt;
+    }
+    if (n > 1)
+        qsort(optim->names, n, sizeof *optim->names, optim_compare_names);
+
+    bool ambiguous = false;
+    OPTIM_STAT(optim, args_scanned, optim->config_start);
+    for (size_t i = 0; i < optim->config_start; i++) {
+        struct optim_arg * arg = &optim->args[i];
+        if (!arg->prefix) continue;
+
+        size_t count = 0;
+        size_t first = optim_find_prefix(optim, optim->names, n, arg->arg, &count);
+        if (count > 1) {
+            optim_report_ambiguous(optim, arg, first);
+            ambiguous = true;
+        }
+    }
+    return ambiguous;
+}
+
+// Declaration of the option with the long name `name` (of `len` bytes), or which `name` is an
+// unambiguous prefix of, or NULL
+static const struct optim_decl * optim_complete_long(const optim_t * optim, const char * name, size_t len) {
+    const struct optim_decl * found = NULL;
+    bool ambiguous = false;
+    for (size_t i = 0; i < optim->n_decls; i++) {
+        const struct optim_decl * decl = &optim->decls[i];
+        if (decl->kind != DECL_OPTION || decl->longopt == NULL || strncmp(decl->longopt, name, len) != 0)
+            continue;
+        if (decl->longopt[len] == '\0')
+            return decl;
+        if (found != NULL && strcmp(found->longopt, decl->longopt) != 0)
+            ambiguous = true;
+        found = decl;
+    }
+    return ambiguous ? NULL : found;
+}
+
+// Declaration of the short option `opt`, or NULL
+static const struct optim_decl * optim_complete_short(const optim_t * optim, char opt) {
+    for (size_t i = 0; i < optim->n_decls; i++) {
+        if (optim->decls[i].kind == DECL_OPTION && optim->decls[i].opt == opt)
+            return &optim->decls[i];
+    }
+    return NULL;
+}
+
+// Declaration of the option which the word being completed is the argument of, or NULL
+static const struct optim_decl * optim_complete_option(const optim_t * optim) {
+    const char * word = optim->complete_word;
+    const struct optim_decl * decl = NULL;
+    const struct optim_arg * arg = optim->config_start > 1 ? &optim->args[optim->config_start - 1] : NULL;
+    if (word[0] == '-' && word[1] == '-') {
+        const char * eq = strchr(word, '=');
+        if (eq != NULL)
+            decl = optim_complete_long(optim, &word[2], (size_t) (eq - &word[2]));
+    } else if (arg != NULL && arg->type == TYPE_LONG) {
+        decl = optim_complete_long(optim, arg->arg, arg->len);
+    } else if (arg != NULL && arg->type == TYPE_FLAGS) {
+        // The first letter which takes an argument takes the rest of the set, if there is any
+        for (const char * c = arg->arg; *c != '\0'; c++) {
+            decl = optim_complete_short(optim, *c);
+            if (decl != NULL && decl->metavar != NULL)
+                return c[1] == '\0' ? decl : NULL;
+        }
+    }
+    return decl != NULL && decl->metavar != NULL ? decl : NULL;
+}
+
+// Print the candidates for the word being completed, for `--optim-complete`, one per line
+// The options are sorted, so that repeated names can be skipped
+// Returns `false` if they couldn't be written
+static bool optim_complete(optim_t * optim, FILE * out) {
+    const char * word = optim->complete_word;
+    size_t len = strlen(word);
+
+    const struct optim_decl * option = optim_complete_option(optim);
+    if (option != NULL) {
+        fprintf(out, ":metavar %s\n", option->metavar);
+        return fflush(out) == 0;
+    }
+
+    // After "--", everything is a positional
+    bool found_sep = false;
+    for (size_t i = 1; i < optim->config_start && !found_sep; i++)
+        found_sep = optim->args[i].type == TYPE_SEP;
+
+    if (word[0] == '-' && !found_sep) {
+        bool seen[256] = {false};
+        bool all = word[1] == '\0';
+        size_t n = 0;
+        optim->names = optim_reserve(optim, optim->names, &optim->names_cap, optim->n_decls * sizeof *optim->names);
+        if (optim->names == NULL && optim->n_decls > 0)
+            return false;
+        for (size_t i = 0; i < optim->n_decls; i++) {
+            const struct optim_decl * decl = &optim->decls[i];
+            if (decl->kind != DECL_OPTION) continue;
+            unsigned char opt = (unsigned char) decl->opt;
+            if (opt != '\0' && !seen[opt] && (all || (word[1] == decl->opt && word[2] == '\0'))) {
+                seen[opt] = true;
+                fprintf(out, "-%c\n", decl->opt);
+            }
+            if (decl->longopt != NULL && (all || (word[1] == '-' && strncmp(decl->longopt, &word[2], len - 2) == 0)))
+                optim->names[n++] = decl->longopt;
+        }
+        if (n > 1)
+            qsort(optim->names, n, sizeof *optim->names, optim_compare_names);
+        for (size_t i = 0; i < n; i++) {
+            if (i == 0 || strcmp(optim->names[i], optim->names[i - 1]) != 0)
+                fprintf(out, "--%s\n", optim->names[i]);
+        }
+        return fflush(out) == 0;
+    }
+
+    if (!found_sep && optim->subcommand == 0) {
+        for (size_t i = 0; i < optim->n_decls; i++) {
+            const struct optim_decl * decl = &optim->decls[i];
+            if (decl->kind == DECL_SUBCOMMAND && strncmp(decl->longopt, word, len) == 0)
+                fprintf(out, "%s\n", decl->longopt);
+        }
+    }
+    if (optim->takes_positionals)
+        fprintf(out, ":positional\n");
+    return fflush(out) == 0;
+}
+
+int optim_end(optim_t * optim) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, -1);
+
+    if (optim->ended)
+        return optim->end_rc;
+
+    OPTIM_PHASE_START(optim);
+    // An ambiguous option might have been taken as `--help` or `--version`
+    bool ambiguous = optim_check_prefixes(optim);
+    optim_check_unused(optim);
+
+    int rc = optim_failed(optim) ? -1 : 0;
+    if (optim->snapshot != NULL) {
+        // A snapshot has no usage message to print with the errors
+        optim_print_errors(optim, stderr);
+    } else if (optim->complete_word != NULL) {
+        // Errors are expected, since the command line isn't finished
+        if (optim->subcommand != 0)
+            rc = optim_end(optim->child);
+        else
+            rc = optim_complete(optim, stdout) ? 1 : -1;
+#ifdef OPTIM_GENERATE
+    } else if (optim->generate != GENERATE_NONE) {
+        // Errors are expected, since the program was not given real arguments
+        rc = optim_generate(optim) ? 1 : -1;
+#endif
+    } else if (ambiguous) {
+        optim_emit_usage(optim, stderr, true);
+    } else if (optim->asked_for_help) {
+        optim_emit_usage(optim, stdout, false);
+        rc = 1;
+    } else if (optim->asked_for_version) {
+        fprintf(stdout, "%s", optim->version);
+        rc = 1;
+    } else if (rc != 0) {
+        optim_emit_usage(optim, stderr, true);
+    } else if (optim->subcommand != 0) {
+        // The options before the subcommand were OK, so finish the subcommand
+        rc = optim_end(optim->child);
+    }
+
+    optim->ended = true;
+    optim->end_rc = rc;
+    OPTIM_PHASE_END(optim, finish_ns);
+    return rc;
+}
+
+int optim_finish(optim_t ** optim_p) {
+    if (optim_p == NULL || *optim_p == NULL)
+        return (OPTIM_INVALID, -1);
+
+    optim_t * optim = *optim_p;
+    int rc = optim_end(optim);
+
+    // Cleanup!
+    optim_destroy(optim);
+    // NULL-out optim to prevent calls to other methods
+    *optim_p = NULL;
+
+    return rc;
+}
+
+// -- Declaring Options --
+
+// Append an entry to the usage message
+// Returns `NULL` if out of memory
+static struct optim_decl * optim_push_decl(optim_t * optim) {
+    assert(optim != NULL);
+
+    if (optim->n_decls == optim->decls_cap) {
+        size_t cap = optim->decls_cap == 0 ? 16 : 2 * optim->decls_cap;
+        struct optim_decl * decls = optim_realloc(optim, optim->decls, optim->decls_cap * sizeof *decls, cap * sizeof *decls);
+        if (decls == NULL) return NULL;
+        optim->decls = decls;
+        optim->decls_cap = cap;
+    }
+
+    struct optim_decl * decl = &optim->decls[optim->n_decls++];
+    memset(decl, 0, sizeof *decl);
+    return decl;
+}
+
+// Record the usage message for the option; it is only formatted if it gets printed
+static void optim_option_usage(optim_t * optim, char opt, const char * longopt, const char * metavar, const char * help) {
+    // Precondition validation
+    assert(optim != NULL);
+    assert(opt != '\0' || longopt != NULL);
+
+    // Print section header if this is the first option
+    if (!optim->started_options) {
+        optim_usage(optim, "\nOptions:\n");
+        optim->started_options = true;
+
+        optim_flag(optim, 'h', "help", "Print this help message");
+        if (optim_get_count(optim) > 0)
+            optim->asked_for_help = true;
+    }
+
+    struct optim_decl * decl = optim_push_decl(optim);
+    if (decl == NULL) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to allocate usage message");
+        return;
+    }
+    decl->kind = DECL_OPTION;
+    decl->opt = opt;
+    decl->longopt = longopt;
+    decl->metavar = metavar;
+    decl->help = help;
+}
+
+// Should the arg at `i` be ignored, because it is from a config file & the current option
+// was also given on the command line? `*command_line_count` starts at -1, and is set
+// to the number of times the option was on the command line at the first config arg
+static bool optim_config_overridden(optim_t * optim, size_t i, int * command_line_count) {
+    if (i < optim->config_start)
+        return false;
+    if (*command_line_count < 0)
+        *command_line_count = optim->cur_count;
+    return *command_line_count > 0;
+}
+
+// Reference to `arg` in `args`, for `next`
+static uint32_t optim_arg_ref(optim_t * optim, const struct optim_arg * arg) {
+    return arg != NULL ? (uint32_t) (arg - optim->args) + 1 : 0;
+}
+
+// Next arg after `arg` in the list for the same option, or NULL
+static struct optim_arg * optim_arg_next(optim_t * optim, const struct optim_arg * arg) {
+    return arg->next != 0 ? &optim->args[arg->next - 1] : NULL;
+}
+
+// Add `arg` to the list of arguments for the current option, keeping the list in argv order
+// `*last_arg` is the end of the list
+static void optim_cur_add(optim_t * optim, struct optim_arg ** last_arg, struct optim_arg * arg) {
+    if (*last_arg == NULL || *last_arg < arg) {
+        // Usually, args are added in order
+        arg->next = 0;
+        if (*last_arg == NULL)
+            optim->cur_arg = arg;
+        else
+            (*last_arg)->next = optim_arg_ref(optim, arg);
+        *last_arg = arg;
+    } else {
+        // Insert before the first arg after it
+        struct optim_arg * prev = NULL;
+        struct optim_arg * after = optim->cur_arg;
+        while (after < arg) {
+            prev = after;
+            after = optim_arg_next(optim, after);
+        }
+        arg->next = optim_arg_ref(optim, after);
+        if (prev == NULL)
+            optim->cur_arg = arg;
+        else
+            prev->next = optim_arg_ref(optim, arg);
+    }
+    optim->cur_count++;
+}
+
+// Value of `arg` in the list of an option or the positionals
+// Returns `NULL` if it doesn't have one
+static const char * optim_arg_value(const struct optim_arg * arg) {
+    switch ((enum optim_type) arg->type) {
+    case TYPE_BARE:
+        return arg->arg;
+    case TYPE_FLAGS:
+    case TYPE_LONG_ARG:
+        return optim_rhs(arg);
+    case TYPE_NONE:
+    case TYPE_INVOC:
+    case TYPE_LONG:
+    case TYPE_SEP:
+        break;
+    }
+    return NULL;
+}
+
+// Make room for `n` more strings in `taken`
+// Returns `false` if out of memory
+static bool optim_reserve_taken(optim_t * optim, size_t n) {
+    if (n <= optim->taken_cap - optim->n_taken)
+        return true;
+
+    size_t cap = optim->taken_cap == 0 ? 16 : 2 * optim->taken_cap;
+    while (cap - optim->n_taken < n)
+        cap *= 2;
+    const char ** taken = optim_realloc(optim, optim->taken, optim->taken_cap * sizeof *taken, cap * sizeof *taken);
+    if (taken == NULL) return false;
+    optim->taken = taken;
+    optim->taken_cap = cap;
+    return true;
+}
+
+// Copy the results of the option just declared to its decl, for `optim_snapshot`
+// Its list of args can be relinked later by `optim_unused`, so the arguments are copied to `taken`
+static void optim_record(optim_t * optim) {
+    // If its decl couldn't be allocated, there is already an error
+    struct optim_decl * decl = optim->n_decls > 0 ? &optim->decls[optim->n_decls - 1] : NULL;
+    if (decl == NULL || decl->kind != DECL_OPTION)
+        return;
+
+    // `optim_env` records the option again, & its old arguments are the last ones
+    if (decl->taken + decl->n_taken == optim->n_taken)
+        optim->n_taken = decl->taken;
+    decl->count = optim->cur_count;
+    decl->taken = optim->n_taken;
+    decl->n_taken = 0;
+
+    // Flags are only counted
+    size_t n = optim->cur_arg != NULL ? (size_t) optim->cur_count : 0;
+    if (!optim_reserve_taken(optim, n)) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to record arguments");
+        return;
+    }
+    for (const struct optim_arg * arg = optim->cur_arg; arg != NULL && decl->n_taken < n; arg = optim_arg_next(optim, arg))
+        optim->taken[optim->n_taken + decl->n_taken++] = optim_arg_value(arg);
+    optim->n_taken += decl->n_taken;
+}
+
+// Replay the next record of the snapshot, which should be of `kind` & for the option `opt` & `longopt`
+// Its count & arguments become those of the current option
+static void optim_replay(optim_t * optim, uint8_t kind, char opt, const char * longopt, bool has_arg) {
+    optim->cur_count = 0;
+    optim->snapshot_value = optim->snapshot_values_end = 0;
+
+    const struct optim_snapshot_record * record = NULL;
+    if (optim->snapshot_record < optim->snapshot_n_records)
+        record = &optim->snapshot_records[optim->snapshot_record++];
+    const char * record_longopt = record != NULL && record->longopt != 0 ? optim->snapshot + record->longopt : NULL;
+    bool same_longopt = longopt == NULL ? record_longopt == NULL : record_longopt != NULL && strcmp(longopt, record_longopt) == 0;
+    if (record == NULL || record->kind != kind || record->opt != opt || record->has_arg != has_arg || !same_longopt) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: snapshot does not match the declarations");
+        return;
+    }
+    optim->cur_count = record->count;
+    optim->snapshot_value = record->values;
+    optim->snapshot_values_end = (size_t) record->values + record->n_values;
+}
+
+// Replay the declaration of an option, after `--help` if it is the first, like `optim_option_usage`
+static void optim_replay_option(optim_t * optim, char opt, const char * longopt, const char * metavar) {
+    if (!optim->started_options) {
+        optim->started_options = true;
+        optim_replay(optim, SNAPSHOT_OPTION, 'h', "help", false);
+    }
+    optim_replay(optim, SNAPSHOT_OPTION, opt, longopt, metavar != NULL);
+}
+
+// Next argument of the current option from the snapshot
+// Returns `NULL` if it doesn't have one, like a flag
+static const char * optim_replay_value(optim_t * optim) {
+    if (optim->snapshot_value == optim->snapshot_values_end)
+        return NULL;
+    return optim->snapshot + optim->snapshot_values[optim->snapshot_value++];
+}
+
+// Take the TYPE_LONG(_ARG) arg at `i` for the current option, along with its argument
+static void optim_take_long_arg(optim_t * optim, size_t i, const char * longopt, struct optim_arg ** last_arg) {
+    struct optim_arg * arg = &optim->args[i];
+    struct optim_arg * next_arg = &optim->args[i+1];
+    // If an earlier option took `arg` as an abbreviation, it also took its argument
+    bool reclaimed = arg->used;
+
+    if (arg->type == TYPE_LONG_ARG) {
+        optim_use(optim, arg);
+        optim_cur_add(optim, last_arg, arg);
+        return;
+    }
+
+    assert(arg->type == TYPE_LONG);
+    if ((next_arg->used && !reclaimed) || next_arg->type != TYPE_BARE) {
+        // It's still taken, so that it's only reported once
+        optim_use(optim, arg);
+        optim_report(optim, OPTIM_DIAG_MISSING_ARG, arg, '\0', longopt, NULL);
+        return;
+    }
+    optim_use(optim, arg);
+    optim_use(optim, next_arg);
+    optim_cur_add(optim, last_arg, next_arg);
+}
+
+// Use `n` occurrences of the letter of `link` in the set of flags `arg`
+// Set `arg->used` once every letter has been used
+static void optim_flag_take(optim_t * optim, struct optim_arg * arg, struct optim_link * link, unsigned n) {
+    assert(link->count >= n);
+    OPTIM_STAT(optim, flagpops, 1);
+    link->count -= n;
+    if (link->count == 0 && !optim_flags_left(optim, link))
+        optim_use(optim, arg);
+}
+
+// Take the argument of the letter of `link` in the set of flags `args[i]`:
+// the rest of the set (`-aARG`), or the next arg if the letter is last (`-a ARG`)
+// Return the arg holding it (at `rhs`, for the set of flags), or NULL if it can't be taken
+static struct optim_arg * optim_flag_arg(optim_t * optim, size_t i, struct optim_link * link) {
+    struct optim_arg * arg = &optim->args[i];
+    struct optim_arg * next_arg = &optim->args[i+1];
+    char opt = link->c;
+
+    if (arg->arg[link->pos + 1] == '\0') {
+        optim_flag_take(optim, arg, link, 1);
+        if (next_arg->used || next_arg->type != TYPE_BARE) {
+            optim_report(optim, OPTIM_DIAG_MISSING_ARG, arg, opt, NULL, NULL);
+            return NULL;
+        }
+        optim_use(optim, next_arg);
+        return next_arg;
+    }
+
+    // The letters after it are the argument, so none of them can have been used as flags
+    // If one was (`-av` after `optim_flag(optim, 'v', ...)`), its count was already read,
+    // so reject the whole set rather than guess
+    char * value = &arg->arg[link->pos + 1];
+    for (const char * c = value; *c != '\0'; c++) {
+        if (optim_flag_link(optim, i, *c)->count > 0) continue;
+        optim_flag_take(optim, arg, link, 1);
+        for (const char * d = value; *d != '\0'; d++) {
+            struct optim_link * l = optim_flag_link(optim, i, *d);
+            if (l->count > 0)
+                optim_flag_take(optim, arg, l, 1);
+        }
+        optim_report(optim, OPTIM_DIAG_TAKEN_ARG, arg, opt, NULL, value);
+        return NULL;
+    }
+    for (const char * c = value; *c != '\0'; c++)
+        optim_flag_take(optim, arg, optim_flag_link(optim, i, *c), 1);
+    optim_flag_take(optim, arg, link, 1);
+    arg->rhs = link->pos + 1;
+    return arg;
+}
+
+void optim_arg(optim_t * optim, char opt, const char * longopt, const char * metavar, const char * help) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    if (opt == '\0' && longopt == NULL) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called without `opt` or `longopt`", __func__);
+        return;
+    }
+    if (optim->takes_positionals) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called after `optim_positionals`", __func__);
+        return;
+    }
+    if (optim->takes_unused) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called after `optim_unused`", __func__);
+        return;
+    }
+
+    if (metavar == NULL)
+        metavar = "ARG";
+    if (optim->snapshot != NULL) {
+        optim_replay_option(optim, opt, longopt, metavar);
+        return;
+    }
+
+    OPTIM_PHASE_START(optim);
+    optim_option_usage(optim, opt, longopt, metavar, help);
+    OPTIM_CONSUMER(optim, optim->n_decls);
+    optim->cur_opt = opt;
+    optim->cur_longopt = longopt;
+    optim->cur_count = 0;
+    optim->cur_arg = NULL;
 
     // Need to preserve the order of the linked list
     struct optim_arg * last_arg = NULL;
-    
-    for (size_t i = 0; i < optim->argc; i++) {
+    int command_line_count = -1;
+
+    // Take abbreviations first, so that they count as being on the command line
+    struct optim_prefixes prefixes = optim_prefixes(longopt);
+    size_t i;
+    while ((i = optim_prefixes_next(optim, &prefixes)) != 0) {
+        struct optim_arg * arg = &optim->args[i];
+        if (arg->used) continue;
+        arg->prefix = true;
+        optim->n_prefixed++;
+        optim_take_long_arg(optim, i, longopt, &last_arg);
+    }
+
+    struct optim_cursor cursor = optim_cursor(optim, opt, longopt);
+    while ((i = optim_cursor_next(optim, &cursor)) != 0) {
+        struct optim_arg * arg = &optim->args[i];
+        // A name given exactly is never an abbreviation, but an option declared before may have taken it as one
+        if (arg->used && !arg->prefix) continue;
+        if (arg->used)
+            optim_report_reclaimed(optim, arg, longopt);
+        arg->prefix = false;
+        if (optim_config_overridden(optim, i, &command_line_count)) {
+            optim_use(optim, arg);
+            continue;
+        }
+        switch ((enum optim_type) arg->type) {
+        case TYPE_NONE: 
+        case TYPE_INVOC: 
+        case TYPE_BARE: 
+        case TYPE_SEP: 
+            break;
+        case TYPE_FLAGS: {
+            if (opt == '\0') break;
+            if (cursor.link->count == 0) break;
+            struct optim_arg * value = optim_flag_arg(optim, i, cursor.link);
+            if (value != NULL)
+                optim_cur_add(optim, &last_arg, value);
+            break;
+        }
+        case TYPE_LONG:
+        case TYPE_LONG_ARG:
+            if (longopt == NULL) break;
+            optim_take_long_arg(optim, i, longopt, &last_arg);
+            break;
+        }
+    }
+    optim_record(optim);
+    OPTIM_PHASE_END(optim, declare_ns);
+}
+
+void optim_flag(optim_t * optim, char opt, const char * longopt, const char * help) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    if (opt == '\0' && longopt == NULL) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called without `opt` or `longopt`", __func__);
+        return;
+    }
+    if (optim->takes_positionals) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called after `optim_positionals`", __func__);
+        return;
+    }
+    if (optim->takes_unused) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called after `optim_unused`", __func__);
+        return;
+    }
+
+    if (optim->snapshot != NULL) {
+        optim_replay_option(optim, opt, longopt, NULL);
+        return;
+    }
+
+    OPTIM_PHASE_START(optim);
+    optim_option_usage(optim, opt, longopt, NULL, help);
+    OPTIM_CONSUMER(optim, optim->n_decls);
+    optim->cur_opt = opt;
+    optim->cur_longopt = longopt;
+    optim->cur_count = 0;
+    optim->cur_arg = NULL;
+    int command_line_count = -1;
+
+    // Take abbreviations first, so that they count as being on the command line
+    struct optim_prefixes prefixes = optim_prefixes(longopt);
+    size_t i;
+    while ((i = optim_prefixes_next(optim, &prefixes)) != 0) {
         struct optim_arg * arg = &optim->args[i];
-        struct optim_arg * next_arg = &optim->args[i+1];
         if (arg->used) continue;
-        switch (arg->type) {
+        arg->prefix = true;
+        optim->n_prefixed++;
+        if (arg->type == TYPE_LONG_ARG) {
+            optim_report(optim, OPTIM_DIAG_UNEXPECTED_ARG, arg, '\0', longopt, optim_rhs(arg));
+            optim_use(optim, arg);
+            continue;
+        }
+        optim->cur_count++;
+        optim_use(optim, arg);
+    }
+
+    struct optim_cursor cursor = optim_cursor(optim, opt, longopt);
+    while ((i = optim_cursor_next(optim, &cursor)) != 0) {
+        struct optim_arg * arg = &optim->args[i];
+        // A name given exactly is never an abbreviation, but an option declared before may have taken it as one
+        if (arg->used && !arg->prefix) continue;
+        if (arg->used)
+            optim_report_reclaimed(optim, arg, longopt);
+        arg->prefix = false;
+        if (optim_config_overridden(optim, i, &command_line_count)) {
+            optim_use(optim, arg);
+            continue;
+        }
+        switch ((enum optim_type) arg->type) {
         case TYPE_NONE: 
         case TYPE_INVOC: 
         case TYPE_BARE: 
         case TYPE_SEP: 
             break;
-        case TYPE_FLAGS:
-            if (opt == '\0') break;
-            if (opt != arg->last) break;
-            if (!arg_flagpop(arg, opt)) {
-                optim_error(optim, "Flag '-%c %s' already consumed", opt, metavar);
-                break;
-            }
-            if (arg_flagpop(arg, opt)) {
-                optim_error(optim, "Flag '-%c %s' specified multiple times in same argument", opt, metavar);
+        case TYPE_FLAGS:
+            assert(arg->arg != NULL);
+            if (opt == '\0') break;
+            if (cursor.link->count == 0) break;
+            optim->cur_count += (int) cursor.link->count;
+            optim_flag_take(optim, arg, cursor.link, cursor.link->count);
+            break;
+        case TYPE_LONG:
+            assert(arg->arg != NULL);
+            if (longopt == NULL) break;
+            optim->cur_count++;
+            optim_use(optim, arg);
+            break;
+        case TYPE_LONG_ARG:
+            assert(arg->arg != NULL);
+            if (longopt == NULL) break;
+            if (i >= optim->config_start) {
+                // Flags in config files can be set to a boolean
+                int value = optim_parse_bool(optim_rhs(arg));
+                if (value < 0) {
+                    optim_report(optim, OPTIM_DIAG_NOT_BOOL, arg, '\0', longopt, optim_rhs(arg));
+                    optim_use(optim, arg);
+                    break;
+                }
+                optim->cur_count += value;
+                optim_use(optim, arg);
+                break;
+            }
+            optim_report(optim, OPTIM_DIAG_UNEXPECTED_ARG, arg, '\0', longopt, optim_rhs(arg));
+            optim_use(optim, arg);
+            break;
+        }
+    }
+    optim_record(optim);
+    OPTIM_PHASE_END(optim, declare_ns);
+}
+
+void optim_env_prefix(optim_t * optim, const char * prefix) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    if (optim->env_indexed) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called after `optim_env`", __func__);
+        return;
+    }
+    optim->env_prefix = prefix;
+}
+
+void optim_env(optim_t * optim, const char * name) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    // The snapshot already has the value from the environment
+    if (optim->snapshot != NULL)
+        return;
+
+    struct optim_decl * decl = optim->n_decls > 0 ? &optim->decls[optim->n_decls - 1] : NULL;
+    if (name == NULL || decl == NULL || decl->kind != DECL_OPTION || (optim->cur_opt == '\0' && optim->cur_longopt == NULL)) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` must be called right after `optim_arg` or `optim_flag`", __func__);
+        return;
+    }
+    decl->env = name;
+
+    // Command line arguments take precedence
+    if (optim->cur_count != 0)
+        return;
+
+    if (!optim->env_indexed) {
+        OPTIM_PHASE_START(optim);
+        bool ok = optim_env_index(optim);
+        OPTIM_PHASE_END(optim, declare_ns);
+        if (!ok) {
+            optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to index environment");
+            return;
+        }
+    }
+    char * value = optim_env_lookup(optim, name);
+    if (value == NULL)
+        return;
+
+    if (decl->metavar == NULL) {
+        // Flags are set by any value other than "", "0", or "false"
+        if (value[0] != '\0' && strcmp(value, "0") != 0 && strcmp(value, "false") != 0)
+            optim->cur_count = 1;
+        optim_record(optim);
+        return;
+    }
+
+    if (optim->env_arg == NULL)
+        optim->env_arg = optim_alloc(optim, sizeof *optim->env_arg);
+    if (optim->env_arg == NULL) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to allocate environment argument");
+        return;
+    }
+    *optim->env_arg = (struct optim_arg) { .type = TYPE_BARE, .arg = value, .used = true };
+    optim->cur_arg = optim->env_arg;
+    optim->cur_count = 1;
+    optim_record(optim);
+}
+
+// Find the subcommand `name` in the trie
+// Returns 1 + the index of its decl, or 0 if it is not a subcommand
+static size_t optim_trie_find(const optim_t * optim, const char * name) {
+    size_t node = 0;
+    size_t next = optim->trie_root;
+    for (const char * c = name; *c != '\0'; c++) {
+        while (next != 0 && optim->trie[next - 1].c != *c)
+            next = optim->trie[next - 1].sibling;
+        if (next == 0)
+            return 0;
+        node = next;
+        next = optim->trie[node - 1].child;
+    }
+    return node == 0 ? 0 : optim->trie[node - 1].decl;
+}
+
+// Add the subcommand `name` with the decl at index `decl` to the trie
+// Returns `false` if out of memory, or if `name` is already in the trie
+static bool optim_trie_insert(optim_t * optim, const char * name, size_t decl) {
+    size_t parent = 0; // The root
+    for (const char * c = name; *c != '\0'; c++) {
+        size_t head = parent == 0 ? optim->trie_root : optim->trie[parent - 1].child;
+        size_t node = head;
+        while (node != 0 && optim->trie[node - 1].c != *c)
+            node = optim->trie[node - 1].sibling;
+        if (node == 0) {
+            if ((optim->n_trie + 1) * sizeof *optim->trie > optim->trie_cap) {
+                size_t cap = optim->trie_cap == 0 ? 64 * sizeof *optim->trie : 2 * optim->trie_cap;
+                struct optim_trie * trie = optim_realloc(optim, optim->trie, optim->trie_cap, cap);
+                if (trie == NULL) return false;
+                optim->trie = trie;
+                optim->trie_cap = cap;
+            }
+            optim->trie[optim->n_trie] = (struct optim_trie) { .c = *c, .sibling = head };
+            node = ++optim->n_trie;
+            if (parent == 0)
+                optim->trie_root = node;
+            else
+                optim->trie[parent - 1].child = node;
+        }
+        parent = node;
+    }
+    if (parent == 0 || optim->trie[parent - 1].decl != 0)
+        return false;
+    optim->trie[parent - 1].decl = decl + 1;
+    return true;
+}
+
+void optim_subcommand(optim_t * optim, const char * name, const char * usage, const char * help) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    if (name == NULL || name[0] == '\0') {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called without `name`", __func__);
+        return;
+    }
+    // A snapshot can't have a subcommand
+    if (optim->snapshot != NULL)
+        return;
+    if (optim->subcommand != 0) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called after `optim_get_subcommand`", __func__);
+        return;
+    }
+
+    // Print section header if this is the first subcommand
+    if (!optim->started_subcommands) {
+        optim_usage(optim, "\nCommands:\n");
+        optim->started_subcommands = true;
+    }
+
+    struct optim_decl * decl = optim_push_decl(optim);
+    if (decl == NULL) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to allocate usage message");
+        return;
+    }
+    decl->kind = DECL_SUBCOMMAND;
+    decl->longopt = name;
+    decl->metavar = usage != NULL ? usage : "";
+    decl->help = help;
+
+    if (!optim_trie_insert(optim, name, optim->n_decls - 1))
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to declare subcommand '%s'", name);
+}
+
+// Find the slot in `table_buckets` for `longopt`; the slot is 0 if no entry in `table` has that name
+static size_t * optim_table_bucket(optim_t * optim, const struct optim_option * table, size_t mask, const char * longopt) {
+    assert(optim->table_buckets != NULL);
+
+    size_t i = optim_hash(longopt) & mask;
+    while (optim->table_buckets[i] != 0) {
+        OPTIM_STAT(optim, strcmps, 1);
+        if (strcmp(table[optim->table_buckets[i] - 1].longopt, longopt) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return &optim->table_buckets[i];
+}
+
+// Find the entry in `table` with a long option starting with `prefix`, using a sorted list of its
+// long options in `names`, which is built by the first call (when `*n_names` is `SIZE_MAX`)
+// Returns 1 + the index of the entry, or 0 if there isn't exactly one (which is reported)
+static size_t optim_table_prefix(optim_t * optim, const struct optim_option * table, size_t n, size_t mask, size_t * n_names, const struct optim_arg * arg) {
+    if (*n_names == SIZE_MAX) {
+        optim->names = optim_reserve(optim, optim->names, &optim->names_cap, n * sizeof *optim->names);
+        if (optim->names == NULL && n > 0) {
+            optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to allocate option names");
+            return 0;
+        }
+        *n_names = 0;
+        for (size_t e = 0; e < n; e++) {
+            if (table[e].longopt != NULL)
+                optim->names[(*n_names)++] = table[e].longopt;
+        }
+        // `names` is NULL if no entry has a long option
+        if (*n_names > 1)
+            qsort(optim->names, *n_names, sizeof *optim->names, optim_compare_names);
+    }
+
+    size_t count = 0;
+    size_t first = optim_find_prefix(optim, optim->names, *n_names, arg->arg, &count);
+    if (count == 0)
+        return 0;
+    if (count > 1) {
+        optim_report_ambiguous(optim, arg, first);
+        return 0;
+    }
+    return *optim_table_bucket(optim, table, mask, optim->names[first]);
+}
+
+// Record a use of `option`, with argument `value` (or `NULL` for a flag)
+// Its decl at `decls[decl - 1]` keeps the same results, for `optim_snapshot`
+static void optim_table_set(optim_t * optim, const struct optim_option * option, size_t decl, const char * value) {
+    if (option->count != NULL)
+        (*option->count)++;
+    if (option->value != NULL && value != NULL)
+        *option->value = value;
+
+    // If the decl couldn't be allocated, there is already an error
+    if (decl == 0 || optim->decls[decl - 1].kind != DECL_OPTION)
+        return;
+    struct optim_decl * d = &optim->decls[decl - 1];
+    d->count++;
+    if (value == NULL)
+        return;
+    if (!optim_reserve_taken(optim, 1)) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to record arguments");
+        return;
+    }
+    // Only the last argument is kept, like `value`
+    d->taken = optim->n_taken++;
+    d->n_taken = 1;
+    optim->taken[d->taken] = value;
+}
+
+// Replay the declarations of a table from the snapshot, & set the results of each entry
+static void optim_replay_table(optim_t * optim, const struct optim_option * table, size_t n) {
+    for (size_t e = 0; e < n; e++) {
+        const struct optim_option * option = &table[e];
+        if (option->opt == '\0' && option->longopt == NULL)
+            continue;
+        optim_replay_option(optim, option->opt, option->longopt, option->metavar);
+        if (option->count != NULL)
+            *option->count = optim->cur_count;
+        if (option->value != NULL && optim->snapshot_values_end > optim->snapshot_value)
+            *option->value = optim->snapshot + optim->snapshot_values[optim->snapshot_values_end - 1];
+    }
+    optim->cur_opt = '\0';
+    optim->cur_longopt = NULL;
+    optim->cur_count = 0;
+}
+
+void optim_parse_table(optim_t * optim, const struct optim_option * table, size_t n) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    if (table == NULL && n > 0) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called without `table`", __func__);
+        return;
+    }
+    if (optim->takes_positionals) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called after `optim_positionals`", __func__);
+        return;
+    }
+    if (optim->takes_unused) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called after `optim_unused`", __func__);
+        return;
+    }
+
+    if (optim->snapshot != NULL) {
+        optim_replay_table(optim, table, n);
+        return;
+    }
+
+    // Build the lookup tables, and record the usage messages in table order
+    // After the buckets is the number of times each entry was on the command line,
+    // and 1 + the index of the decl of each entry, for its results & `used_by`
+    size_t n_columns = 2;
+    size_t short_index[256] = {0};
+    size_t n_buckets = 1;
+    while (n_buckets < 2 * n)
+        n_buckets *= 2;
+    size_t size = (n_buckets + n_columns * n) * sizeof *optim->table_buckets;
+    optim->table_buckets = optim_reserve(optim, optim->table_buckets, &optim->table_buckets_cap, size);
+    if (optim->table_buckets == NULL) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to allocate option table");
+        return;
+    }
+    OPTIM_PHASE_START(optim);
+    memset(optim->table_buckets, 0, size);
+    size_t mask = n_buckets - 1;
+    size_t * command_line_counts = &optim->table_buckets[n_buckets];
+    size_t * entry_decls = &command_line_counts[n];
+    size_t n_names = SIZE_MAX;
+
+    for (size_t e = 0; e < n; e++) {
+        const struct optim_option * option = &table[e];
+        if (option->opt == '\0' && option->longopt == NULL) {
+            // Entries without an option are text for the usage message, like `optim_usage`
+            struct optim_decl * decl = option->help != NULL ? optim_push_decl(optim) : NULL;
+            if (decl == NULL) {
+                optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` entry %zu has no `opt`, `longopt`, or `help`", __func__, e);
+                continue;
+            }
+            decl->kind = DECL_TEXT;
+            decl->help = option->help;
+            continue;
+        }
+
+        optim_option_usage(optim, option->opt, option->longopt, option->metavar, option->help);
+        entry_decls[e] = optim->n_decls;
+        if (option->count != NULL)
+            *option->count = 0;
+
+        // If an option is repeated, the first entry wins
+        if (option->opt != '\0' && short_index[(unsigned char) option->opt] == 0)
+            short_index[(unsigned char) option->opt] = e + 1;
+        if (option->longopt != NULL) {
+            size_t * bucket = optim_table_bucket(optim, table, mask, option->longopt);
+            if (*bucket == 0)
+                *bucket = e + 1;
+        }
+    }
+
+    optim->cur_opt = '\0';
+    optim->cur_longopt = NULL;
+    optim->cur_count = 0;
+    optim->cur_arg = NULL;
+
+    // One pass over the arguments, in argv order
+    OPTIM_STAT(optim, args_scanned, optim->argc - 1);
+    for (size_t i = 1; i < optim->argc; i++) {
+        struct optim_arg * arg = &optim->args[i];
+        struct optim_arg * next_arg = &optim->args[i+1];
+        // An option declared before may have taken one of the names in `table` as an abbreviation
+        bool reclaimed = arg->used;
+        if (arg->used && !arg->prefix) continue;
+
+        const struct optim_option * option = NULL;
+        switch ((enum optim_type) arg->type) {
+        case TYPE_NONE:
+        case TYPE_INVOC:
+        case TYPE_BARE:
+        case TYPE_SEP:
+            break;
+        case TYPE_FLAGS: {
+            // The first option with an argument takes the rest of the letters, or the next arg
+            // Letters of known options before it are used, leaving the rest for `optim_check_unused`
+            // The argument is taken first, so that the counts left are only for the letters before it
+            const char * end = arg->arg + arg->len;
+            for (const char * c = arg->arg; c < end; c++) {
+                size_t e = short_index[(unsigned char) *c];
+                if (e == 0 || table[e - 1].metavar == NULL) continue;
+                struct optim_link * link = optim_flag_link(optim, i, *c);
+                if (link->count == 0) continue;
+                end = c;
+                OPTIM_CONSUMER(optim, entry_decls[e - 1]);
+                struct optim_arg * value = optim_flag_arg(optim, i, link);
+                if (value != NULL) {
+                    command_line_counts[e - 1]++;
+                    optim_table_set(optim, &table[e - 1], entry_decls[e - 1], value == arg ? optim_rhs(arg) : value->arg);
+                }
                 break;
             }
-            if (next_arg->used || next_arg->type != TYPE_BARE) {
-                optim_error(optim, "Flag '-%c' is missing its argument", opt);
-                break;
+            for (const char * c = arg->arg; c < end; c++) {
+                size_t e = short_index[(unsigned char) *c];
+                if (e == 0 || table[e - 1].metavar != NULL) continue;
+                struct optim_link * link = optim_flag_link(optim, i, *c);
+                if (link->count == 0) continue;
+                OPTIM_CONSUMER(optim, entry_decls[e - 1]);
+                optim_flag_take(optim, arg, link, 1);
+                command_line_counts[e - 1]++;
+                optim_table_set(optim, &table[e - 1], entry_decls[e - 1], NULL);
             }
-            arg->used = true;
-            next_arg->used = true;
-            if (optim->cur_arg == NULL)
-                optim->cur_arg = next_arg;
-            if (last_arg != NULL)
-                last_arg->next = next_arg;
-            last_arg = next_arg;
-            optim->cur_count++;
             break;
+        }
         case TYPE_LONG:
-            if (longopt == NULL) break;
-            if (strcmp(arg->arg, longopt) != 0) break;
-            if (next_arg->used || next_arg->type != TYPE_BARE) {
-                optim_error(optim, "Flag '--%s' is missing its argument", longopt);
+        case TYPE_LONG_ARG: {
+            size_t e = *optim_table_bucket(optim, table, mask, arg->arg);
+            if (reclaimed && e == 0) break;
+            if (reclaimed)
+                optim_report_reclaimed(optim, arg, table[e - 1].longopt);
+            arg->prefix = false;
+            if (e == 0 && i < optim->config_start) {
+                // Long options on the command line can be abbreviated
+                e = optim_table_prefix(optim, table, n, mask, &n_names, arg);
+                if (e != 0) {
+                    arg->prefix = true;
+                    optim->n_prefixed++;
+                }
+            }
+            if (e == 0) break;
+            option = &table[e - 1];
+            OPTIM_CONSUMER(optim, entry_decls[e - 1]);
+
+            // Config files only apply to options which weren't on the command line
+            bool from_config = i >= optim->config_start;
+            if (from_config && command_line_counts[e - 1] > 0) {
+                optim_use(optim, arg);
                 break;
             }
-            arg->used = true;
-            next_arg->used = true;
-            if (optim->cur_arg == NULL)
-                optim->cur_arg = next_arg;
-            if (last_arg != NULL)
-                last_arg->next = next_arg;
-            last_arg = next_arg;
-            optim->cur_count++;
-            break;
-        case TYPE_LONG_ARG:
-            if (longopt == NULL) break;
-            if (strcmp(arg->arg, longopt) != 0) break;
-            arg->used = true;
-            if (optim->cur_arg == NULL)
-                optim->cur_arg = arg;
-            if (last_arg != NULL)
-                last_arg->next = arg;
-            last_arg = arg;
-            optim->cur_count++;
+
+            const char * value = NULL;
+            if (arg->type == TYPE_LONG_ARG && option->metavar == NULL) {
+                int set = from_config ? optim_parse_bool(optim_rhs(arg)) : -1;
+                if (set < 0) {
+                    optim_report(optim, from_config ? OPTIM_DIAG_NOT_BOOL : OPTIM_DIAG_UNEXPECTED_ARG, arg, '\0', option->longopt, optim_rhs(arg));
+                    optim_use(optim, arg);
+                    break;
+                }
+                optim_use(optim, arg);
+                if (set == 0) break;
+            } else if (arg->type == TYPE_LONG_ARG) {
+                optim_use(optim, arg);
+                value = optim_rhs(arg);
+            } else if (option->metavar != NULL) {
+                if ((next_arg->used && !reclaimed) || next_arg->type != TYPE_BARE) {
+                    optim_use(optim, arg);
+                    optim_report(optim, OPTIM_DIAG_MISSING_ARG, arg, '\0', option->longopt, NULL);
+                    break;
+                }
+                optim_use(optim, next_arg);
+                value = next_arg->arg;
+            }
+            optim_use(optim, arg);
+            if (!from_config)
+                command_line_counts[e - 1]++;
+            optim_table_set(optim, option, entry_decls[e - 1], value);
             break;
         }
+        }
+    }
+    OPTIM_PHASE_END(optim, declare_ns);
+}
+
+void optim_positionals(optim_t * optim) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    if (optim->takes_unused) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called after `optim_unused`", __func__);
+        return;
+    }
+    if (optim->takes_positionals)
+        return;
+    if (optim->snapshot != NULL) {
+        optim->takes_positionals = true;
+        optim_replay(optim, SNAPSHOT_POSITIONALS, '\0', NULL, false);
+        return;
+    }
+
+    OPTIM_PHASE_START(optim);
+    OPTIM_CONSUMER(optim, OPTIM_BY_POSITIONALS);
+    optim->takes_positionals = true;
+    optim->cur_opt = '\0';
+    optim->cur_longopt = NULL;
+    optim->cur_count = 0;
+    optim->cur_arg = NULL;
+
+    struct optim_arg * last_arg = NULL;
+
+    OPTIM_STAT(optim, args_scanned, optim->argc);
+    for (size_t i = 0; i < optim->argc; i++) {
+        struct optim_arg * arg = &optim->args[i];
+        if (arg->used) continue;
+        if (arg->type != TYPE_BARE) continue;
+
+        if (optim->cur_arg == NULL)
+            optim->cur_arg = arg;
+        if (last_arg != NULL)
+            last_arg->next = optim_arg_ref(optim, arg);
+        last_arg = arg;
+        optim->cur_count++;
+    }
+    optim->positionals.head = optim_arg_ref(optim, optim->cur_arg);
+    optim->positionals.n = (size_t) optim->cur_count;
+    OPTIM_PHASE_END(optim, declare_ns);
+}
+
+// Read the next positional from the stream, or return `NULL` at the end
+// The returned string is only valid until the next read
+static const char * optim_stream_next(optim_t * optim) {
+    struct optim_stream * stream = optim->stream;
+    assert(stream != NULL);
+
+    if (stream->pending != NULL) {
+        const char * str = stream->pending;
+        stream->pending = NULL;
+        return str;
+    }
+
+    while (true) {
+        char * start = &stream->buf[stream->start];
+        char * delim = memchr(start, stream->delim, stream->end - stream->start);
+        if (delim != NULL) {
+            *delim = '\0';
+            stream->start = (size_t) (delim - stream->buf) + 1;
+            // Skip empty positionals
+            if (delim == start) continue;
+            return start;
+        }
+        if (stream->eof) {
+            if (stream->start == stream->end)
+                return NULL;
+            // The last positional doesn't have a delimiter, there is always room to terminate it
+            stream->buf[stream->end] = '\0';
+            stream->start = stream->end;
+            return start;
+        }
+
+        // Move the partial positional to the start of the buffer, and read more
+        if (stream->start > 0) {
+            memmove(stream->buf, start, stream->end - stream->start);
+            stream->end -= stream->start;
+            stream->start = 0;
+        }
+        if (stream->end == sizeof stream->buf - 1) {
+            optim_text_error(optim, OPTIM_DIAG_STREAM, "Positional argument is longer than %zu bytes", sizeof stream->buf - 1);
+            stream->eof = true;
+            stream->start = stream->end = 0;
+            return NULL;
+        }
+        ssize_t rc = read(stream->fd, &stream->buf[stream->end], sizeof stream->buf - 1 - stream->end);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0) {
+            optim_text_error(optim, OPTIM_DIAG_STREAM, "Unable to read positional arguments: %s", strerror(errno));
+            stream->eof = true;
+            stream->start = stream->end = 0;
+            return NULL;
+        }
+        if (rc == 0)
+            stream->eof = true;
+        stream->end += (size_t) rc;
+    }
+}
+
+void optim_positionals_stream(optim_t * optim, int fd, char delim) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    if (optim->stream != NULL && optim->stream->active) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called more than once", __func__);
+        return;
+    }
+
+    optim_positionals(optim);
+    if (optim->takes_unused) return;
+    // Only the positionals from `argv` are in a snapshot, & completion doesn't read them
+    if (optim->snapshot != NULL || optim->complete_word != NULL) return;
+
+    // The buffer is kept across `optim_reset`
+    if (optim->stream == NULL)
+        optim->stream = optim_alloc(optim, sizeof *optim->stream);
+    if (optim->stream == NULL) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to allocate positional stream");
+        return;
+    }
+    struct optim_stream * stream = optim->stream;
+    stream->fd = fd;
+    stream->delim = delim;
+    stream->eof = false;
+    stream->start = stream->end = 0;
+    stream->pending = NULL;
+    stream->active = true;
+}
+
+// Copy the arguments of the positionals or unused args to `taken`, for `optim_snapshot`
+// Returns `false` if out of memory
+static bool optim_copy_list(optim_t * optim, struct optim_list * list) {
+    if (list->copied)
+        return true;
+    if (!optim_reserve_taken(optim, list->n))
+        return false;
+
+    list->taken = optim->n_taken;
+    const struct optim_arg * arg = list->head != 0 ? &optim->args[list->head - 1] : NULL;
+    for (size_t i = 0; i < list->n; i++, arg = optim_arg_next(optim, arg))
+        optim->taken[optim->n_taken++] = arg->arg;
+    list->copied = true;
+    return true;
+}
+
+void optim_unused(optim_t * optim) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    if (optim->takes_unused)
+        return;
+    if (optim->snapshot != NULL) {
+        optim->takes_unused = true;
+        optim_replay(optim, SNAPSHOT_UNUSED, '\0', NULL, false);
+        return;
+    }
+
+    // The positionals which are left are relinked into the unused args, so they are copied first
+    if (optim->takes_positionals && !optim_copy_list(optim, &optim->positionals)) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to record positionals");
+        return;
+    }
+
+    OPTIM_PHASE_START(optim);
+    OPTIM_CONSUMER(optim, OPTIM_BY_UNUSED);
+    optim->takes_unused = true;
+    optim->cur_opt = '\0';
+    optim->cur_longopt = NULL;
+    optim->cur_count = 0;
+    optim->cur_arg = NULL;
+
+    struct optim_arg * last_arg = NULL;
+
+    // Sets of flags are returned as the letters which are left, e.g. "-vx" of "-vax" after `-a`
+    size_t len = 0;
+    for (size_t i = 0; i < optim->config_start; i++) {
+        if (optim->args[i].type == TYPE_FLAGS && !optim->args[i].used)
+            len += strlen(optim->argv[i]) + 1;
+    }
+    optim->flags_left = optim_reserve(optim, optim->flags_left, &optim->flags_left_cap, len);
+    if (optim->flags_left == NULL && len > 0) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to allocate unused flags");
+        OPTIM_PHASE_END(optim, declare_ns);
+        return;
+    }
+    char * left = optim->flags_left;
+
+    // Args from config files are not taken, and are reported as unused
+    OPTIM_STAT(optim, args_scanned, optim->config_start);
+    for (size_t i = 0; i < optim->config_start; i++) {
+        struct optim_arg * arg = &optim->args[i];
+        if (arg->used) continue;
+
+        // Rehydrate stripped forms
+        if (arg->type == TYPE_FLAGS) {
+            // A letter taking the rest of the set as its argument ends it
+            const char * end = arg->rhs != 0 ? arg->arg + arg->rhs - 1 : arg->arg + arg->len;
+            char * str = left;
+            *left++ = '-';
+            for (const char * c = arg->arg; c < end; c++) {
+                if (optim_flag_link(optim, i, *c)->count > 0)
+                    *left++ = *c;
+            }
+            *left++ = '\0';
+            arg->arg = str;
+            arg->rhs = 0;
+        } else {
+            if (arg->rhs != 0) {
+                optim_rhs(arg)[-1] = '=';
+                arg->rhs += (uint32_t) (arg->arg - optim->argv[i]);
+            }
+            arg->arg = optim->argv[i];
+        }
+
+        if (optim->cur_arg == NULL)
+            optim->cur_arg = arg;
+        if (last_arg != NULL)
+            last_arg->next = optim_arg_ref(optim, arg);
+        last_arg = arg;
+        optim->cur_count++;
+    }
+    optim->unused.head = optim_arg_ref(optim, optim->cur_arg);
+    optim->unused.n = (size_t) optim->cur_count;
+    OPTIM_PHASE_END(optim, declare_ns);
+}
+
+// -- Reading Options --
+
+// Take the next argument in the current option, and get its value
+// Returns `NULL` if it is not available
+static const char * optim_pop_string(optim_t * optim) {
+    assert(optim != NULL);
+
+    if (optim->cur_count <= 0)
+        return NULL;
+
+    optim->cur_count--;
+    if (optim->snapshot != NULL)
+        return optim_replay_value(optim);
+
+    struct optim_arg * arg = optim->cur_arg;
+    // Flags are counted, but have no arguments
+    if (arg == NULL)
+        return NULL;
+    optim->cur_arg = optim_arg_next(optim, arg);
+    // Positionals & unused args are used once they are read
+    // A set of flags which holds an argument still has letters for other options
+    if (!arg->used && (arg->type != TYPE_FLAGS || optim->takes_unused))
+        optim_use(optim, arg);
+
+    if (optim->takes_unused)
+        return arg->arg;
+
+    const char * value = optim_arg_value(arg);
+    if (value != NULL)
+        return value;
+
+    // There was a logic error if we get here
+    assert(0);
+    optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` unable to handle argument type '%d'", __func__, arg->type);
+    return NULL;
+}
+
+// The number parsers handle plain decimal numbers without calling into libc, so they do not
+// depend on the locale; other forms (hex, octal, exponents, ...) fall back to `strto*`
+
+// Parse a run of decimal digits at `*str` into `*out`, advancing `*str`
+// Returns the number of digits, or `-1` on overflow
+static int optim_parse_digits(const char ** str, uint64_t * out) {
+    const char * s = *str;
+    uint64_t x = 0;
+    int n = 0;
+    while (*s >= '0' && *s <= '9') {
+        uint64_t d = (uint64_t) (*s++ - '0');
+        if (x > (UINT64_MAX - d) / 10)
+            return -1;
+        x = x * 10 + d;
+        n++;
+    }
+    *str = s;
+    *out = x;
+    return n;
+}
+
+// Load the 8 bytes at `s` into a word, with `s[0]` in the lowest byte on any byte order
+// Compilers turn this into a single load
+static uint64_t optim_load8(const char * s) {
+    uint64_t w = 0;
+    for (int i = 7; i >= 0; i--)
+        w = w << 8 | (unsigned char) s[i];
+    return w;
+}
+
+// Parse exactly `len` decimal digits at `s`, 8 at a time within a word
+// There can be at most 19 digits, so that it can't overflow
+// Returns `false` if they aren't all digits
+static bool optim_parse_digits_n(const char * s, size_t len, uint64_t * out) {
+    assert(len <= 19);
+    uint64_t x = 0;
+    size_t head = len % 8;
+    for (size_t i = 0; i < head; i++) {
+        if (s[i] < '0' || s[i] > '9')
+            return false;
+        x = x * 10 + (uint64_t) (s[i] - '0');
+    }
+    for (size_t i = head; i < len; i += 8) {
+        uint64_t w = optim_load8(&s[i]);
+        // Each byte is a digit if its high nibble is 3, and adding 6 doesn't carry out of the low nibble
+        if (((w & 0xF0F0F0F0F0F0F0F0u) | (((w + 0x0606060606060606u) & 0xF0F0F0F0F0F0F0F0u) >> 4)) != 0x3333333333333333u)
+            return false;
+        // Combine pairs of digits, then pairs of those, then the two halves
+        w = (w & 0x0F0F0F0F0F0F0F0Fu) * 2561 >> 8;
+        w = (w & 0x00FF00FF00FF00FFu) * 6553601 >> 16;
+        w = (w & 0x0000FFFF0000FFFFu) * 42949672960001u >> 32;
+        x = x * 100000000 + w;
+    }
+    *out = x;
+    return true;
+}
+
+// Parse a plain decimal number, without leading zeros (which would make it octal)
+// Returns `false` if `str` is not in that form, or overflows
+static bool optim_parse_decimal(const char * str, uint64_t * out) {
+    if (str[0] == '0' && str[1] != '\0')
+        return false;
+    size_t len = strlen(str);
+    if (len > 0 && len <= 19)
+        return optim_parse_digits_n(str, len, out);
+    return optim_parse_digits(&str, out) > 0 && *str == '\0';
+}
+
+static bool optim_parse_ulong(const char * str, unsigned long * out) {
+    uint64_t x;
+    if (optim_parse_decimal(str, &x))
+        return x <= ULONG_MAX ? (*out = (unsigned long) x, true) : false;
+
+    // `strtoul` would accept (and negate) a leading '-'
+    const char * s = str;
+    while (*s == ' ' || (*s >= '\t' && *s <= '\r'))
+        s++;
+    if (*s == '-')
+        return false;
+
+    char * p = NULL;
+    errno = 0;
+    *out = strtoul(str, &p, 0);
+    return str[0] != '\0' && p != NULL && p[0] == '\0' && errno != ERANGE;
+}
+
+static bool optim_parse_uint64(const char * str, uint64_t * out) {
+    if (optim_parse_decimal(str, out))
+        return true;
+
+    const char * s = str;
+    while (*s == ' ' || (*s >= '\t' && *s <= '\r'))
+        s++;
+    if (*s == '-')
+        return false;
+
+    char * p = NULL;
+    errno = 0;
+    unsigned long long x = strtoull(str, &p, 0);
+    *out = (uint64_t) x;
+    return str[0] != '\0' && p != NULL && p[0] == '\0' && errno != ERANGE;
+}
+
+static bool optim_parse_long(const char * str, long * out) {
+    uint64_t x;
+    const char * digits = str[0] == '-' || str[0] == '+' ? &str[1] : str;
+    if (optim_parse_decimal(digits, &x)) {
+        if (str[0] == '-' && x <= (uint64_t) LONG_MAX + 1)
+            return (*out = x == (uint64_t) LONG_MAX + 1 ? LONG_MIN : -(long) x, true);
+        if (str[0] != '-' && x <= LONG_MAX)
+            return (*out = (long) x, true);
+        return false;
+    }
+
+    char * p = NULL;
+    errno = 0;
+    *out = strtol(str, &p, 0);
+    return str[0] != '\0' && p != NULL && p[0] == '\0' && errno != ERANGE;
+}
+
+static bool optim_parse_double(const char * str, double * out) {
+    // Exact powers of 10 as doubles
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+
+    // [-+]digits[.digits] with at most 15 significant digits is exact as mantissa / 10^n
+    const char * s = str[0] == '-' || str[0] == '+' ? &str[1] : str;
+    size_t len = strlen(s);
+    const char * dot = memchr(s, '.', len);
+    size_t n_int = dot != NULL ? (size_t) (dot - s) : len;
+    size_t n_frac = dot != NULL ? len - n_int - 1 : 0;
+    uint64_t int_part, frac_part;
+    if (n_int + n_frac > 0 && n_int + n_frac <= 15 &&
+            optim_parse_digits_n(s, n_int, &int_part) && optim_parse_digits_n(&s[n_int + 1], n_frac, &frac_part)) {
+        double x = (double) (int_part * (uint64_t) pow10[n_frac] + frac_part) / pow10[n_frac];
+        *out = str[0] == '-' ? -x : x;
+        return true;
+    }
+
+    char * p = NULL;
+    errno = 0;
+    *out = strtod(str, &p);
+    return str[0] != '\0' && p != NULL && p[0] == '\0' && errno != ERANGE;
+}
+
+// Multiply `*x` by `mul`, returning `false` on overflow
+static bool optim_mul_u64(uint64_t * x, uint64_t mul) {
+    if (mul != 0 && *x > UINT64_MAX / mul)
+        return false;
+    *x *= mul;
+    return true;
+}
+
+// Parse a size in bytes, with an optional binary suffix: `64K`, `2G`, `1MiB`, `512B`
+static bool optim_parse_size(const char * str, uint64_t * out) {
+    const char * s = str;
+    uint64_t x;
+    if (optim_parse_digits(&s, &x) <= 0)
+        return false;
+
+    int shift = 0;
+    switch (*s) {
+    case 'k': case 'K': shift = 10; break;
+    case 'm': case 'M': shift = 20; break;
+    case 'g': case 'G': shift = 30; break;
+    case 't': case 'T': shift = 40; break;
+    case 'p': case 'P': shift = 50; break;
+    case 'e': case 'E': shift = 60; break;
+    }
+    if (shift != 0) {
+        s++;
+        if (*s == 'i' && (s[1] == 'B' || s[1] == 'b'))
+            s++;
+    }
+    if (*s == 'B' || *s == 'b')
+        s++;
+    if (*s != '\0')
+        return false;
+
+    if (!optim_mul_u64(&x, (uint64_t) 1 << shift))
+        return false;
+    *out = x;
+    return true;
+}
+
+// Parse a duration into nanoseconds, as a sequence of numbers with units: `250ms`, `1h30m`, `1.5s`
+// Units are `ns`, `us`, `ms`, `s`, `m`, `h`, and `d`. A single number without a unit is in seconds.
+static bool optim_parse_duration(const char * str, uint64_t * out) {
+    static const struct {
+        const char * unit;
+        uint64_t ns;
+    } units[] = {
+        {"ns", UINT64_C(1)},
+        {"us", UINT64_C(1000)},
+        {"ms", UINT64_C(1000000)},
+        {"s", UINT64_C(1000000000)},
+        {"m", UINT64_C(60000000000)},
+        {"h", UINT64_C(3600000000000)},
+        {"d", UINT64_C(86400000000000)},
+    };
+
+    const char * s = str;
+    uint64_t total = 0;
+    do {
+        uint64_t whole = 0;
+        uint64_t frac = 0;
+        uint64_t frac_div = 1;
+        int n = optim_parse_digits(&s, &whole);
+        if (n < 0) return false;
+        if (*s == '.') {
+            s++;
+            while (*s >= '0' && *s <= '9') {
+                // Digits past 1ns of a day don't matter
+                if (frac_div < 100000000000000u) {
+                    frac = frac * 10 + (uint64_t) (*s - '0');
+                    frac_div *= 10;
+                }
+                s++;
+                n++;
+            }
+        }
+        if (n <= 0) return false;
+
+        uint64_t unit = 0;
+        size_t len = 0;
+        for (size_t i = 0; i < sizeof units / sizeof *units; i++) {
+            size_t ulen = strlen(units[i].unit);
+            if (ulen > len && strncmp(s, units[i].unit, ulen) == 0) {
+                unit = units[i].ns;
+                len = ulen;
+            }
+        }
+        if (len == 0) {
+            // A bare number is in seconds, but only on its own
+            if (s != &str[strlen(str)] || total != 0 || s == str)
+                return false;
+            unit = units[3].ns;
+        }
+        s += len;
+
+        if (!optim_mul_u64(&whole, unit))
+            return false;
+        uint64_t part = whole + (uint64_t) ((double) frac / (double) frac_div * (double) unit);
+        if (part < whole || total + part < total)
+            return false;
+        total += part;
+    } while (*s != '\0');
+
+    *out = total;
+    return true;
+}
+
+int optim_get_count(optim_t * optim) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, -1);
+
+    if (optim->cur_count < 0)
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called before `optim_arg`, `optim_flag`, `optim_positionals`, or `optim_unused`", __func__);
+
+    // Peek at the stream once the positionals from `argv` run out
+    if (optim->cur_count == 0 && optim->stream != NULL && optim->stream->active && !optim->takes_unused) {
+        if (optim->stream->pending == NULL)
+            optim->stream->pending = optim_stream_next(optim);
+        return optim->stream->pending != NULL;
+    }
+
+    return optim->cur_count;
+}
+
+const char * optim_get_string(optim_t * optim, const char * empty) {
+    if (optim == NULL) { OPTIM_INVALID; return empty; }
+
+    if (optim->cur_count < 0)  {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called before `optim_arg`, `optim_flag`, `optim_positionals`, or `optim_unused`", __func__);
+        return empty;
+    }
+
+    if (optim->cur_count == 0 && optim->stream != NULL && optim->stream->active && !optim->takes_unused) {
+        const char * str = optim_stream_next(optim);
+        return str != NULL ? str : empty;
+    }
+
+    if (optim->cur_count == 0)
+        return empty;
+
+    const char * str = optim_pop_string(optim);
+    return str != NULL ? str : empty;
+}
+
+size_t optim_get_strings(optim_t * optim, const char ** out, size_t n) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, 0);
+
+    if (optim->cur_count < 0)  {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called before `optim_arg`, `optim_flag`, `optim_positionals`, or `optim_unused`", __func__);
+        return 0;
+    }
+
+    size_t i = 0;
+    while (i < n && optim->cur_count > 0) {
+        const char * str = optim_pop_string(optim);
+        if (str == NULL) break;
+        out[i++] = str;
+    }
+    return i;
+}
+
+// Fetch the next argument for one of the typed getters
+// Returns `NULL` if it is not available
+static const char * optim_get_typed(optim_t * optim, const char * func) {
+    assert(optim != NULL);
+
+    if (optim->cur_count < 0) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called before `optim_arg`, `optim_flag`, `optim_positionals`, or `optim_unused`", func);
+        return NULL;
+    }
+
+    return optim_get_string(optim, NULL);
+}
+
+long optim_get_long(optim_t * optim, long empty) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, empty);
+
+    const char * strarg = optim_get_typed(optim, __func__);
+    if (strarg == NULL) return empty;
+
+    long rc;
+    if (!optim_parse_long(strarg, &rc)) {
+        optim_parse_error(optim, OPTIM_DIAG_BAD_NUMBER, strarg);
+        return empty;
     }
+    return rc;
 }
 
-void optim_flag(optim_t * optim, char opt, const char * longopt, const char * help) {
-    if (optim == NULL) { OPTIM_INVALID; return; }
+size_t optim_get_longs(optim_t * optim, long * out, size_t n) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, 0);
 
-    if (opt == '\0' && longopt == NULL) {
-        optim_error(optim, "Internal optim error: `%s` called without `opt` or `longopt`", __func__);
-        return;
-    }
-    if (optim->takes_positionals) {
-        optim_error(optim, "Internal optim error: `%s` called after `optim_positionals`", __func__);
-        return;
+    if (optim->cur_count < 0) {
+        optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: `%s` called before `optim_arg`, `optim_flag`, `optim_positionals`, or `optim_unused`", __func__);
+        return 0;
     }
-    if (optim->takes_unused) {
-        optim_error(optim, "Internal optim error: `%s` called after `optim_unused`", __func__);
-        return;
+
+    size_t i = 0;
+    while (i < n && optim->cur_count > 0) {
+        const char * strarg = optim_pop_string(optim);
+        if (strarg == NULL) break;
+        if (!optim_parse_long(strarg, &out[i])) {
+            optim_parse_error(optim, OPTIM_DIAG_BAD_NUMBER, strarg);
+            break;
+        }
+        i++;
     }
+    return i;
+}
 
-    optim_option_usage(optim, opt, longopt, NULL, help);
-    optim->cur_opt = opt;
-    optim->cur_longopt = longopt;
-    optim->cur_count = 0;
-    optim->cur_arg = NULL;
+// Take the positionals for one of the `optim_positionals_*` conversions
+// Returns `false` if there are none to take
+static bool optim_positionals_typed(optim_t * optim, size_t * parsed) {
+    assert(optim != NULL);
 
-    for (size_t i = 0; i < optim->argc; i++) {
-        struct optim_arg * arg = &optim->args[i];
-        if (arg->used) continue;
-        switch (arg->type) {
-        case TYPE_NONE: 
-        case TYPE_INVOC: 
-        case TYPE_BARE: 
-        case TYPE_SEP: 
-            break;
-        case TYPE_FLAGS:
-            assert(arg->arg != NULL);
-            if (opt == '\0') break;
-            while (arg_flagpop(arg, opt))
-                optim->cur_count++;
-            break;
-        case TYPE_LONG:
-            assert(arg->arg != NULL);
-            if (longopt == NULL) break;
-            if (strcmp(arg->arg, longopt) != 0) break;
-            optim->cur_count++;
-            arg->used = true;
-            break;
-        case TYPE_LONG_ARG:
-            assert(arg->arg != NULL);
-            if (longopt == NULL) break;
-            if (strcmp(arg->arg, longopt) != 0) break;
-            optim_error(optim, "Flag '--%s' does not take an argument", arg->arg);
-            break;
+    if (parsed != NULL)
+        *parsed = 0;
+    optim_positionals(optim);
+    return !optim->takes_unused;
+}
+
+int optim_positionals_longs(optim_t * optim, long * out, size_t n, size_t * parsed) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, -1);
+    if (!optim_positionals_typed(optim, parsed))
+        return -1;
+
+    for (size_t i = 0; i < n && optim->cur_count > 0; i++) {
+        const char * strarg = optim_pop_string(optim);
+        if (!optim_parse_long(strarg, &out[i])) {
+            optim_parse_error(optim, OPTIM_DIAG_BAD_NUMBER, strarg);
+            return -1;
         }
+        if (parsed != NULL)
+            *parsed = i + 1;
     }
+    return 0;
 }
 
-void optim_positionals(optim_t * optim) {
-    if (optim == NULL) { OPTIM_INVALID; return; }
+int optim_positionals_uint64s(optim_t * optim, uint64_t * out, size_t n, size_t * parsed) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, -1);
+    if (!optim_positionals_typed(optim, parsed))
+        return -1;
 
-    if (optim->takes_unused) {
-        optim_error(optim, "Internal optim error: `%s` called after `optim_unused`", __func__);
-        return;
+    for (size_t i = 0; i < n && optim->cur_count > 0; i++) {
+        const char * strarg = optim_pop_string(optim);
+        if (!optim_parse_uint64(strarg, &out[i])) {
+            optim_parse_error(optim, OPTIM_DIAG_BAD_NUMBER, strarg);
+            return -1;
+        }
+        if (parsed != NULL)
+            *parsed = i + 1;
     }
-    if (optim->takes_positionals)
-        return;
+    return 0;
+}
 
-    optim->takes_positionals = true;
-    optim->cur_opt = '\0';
-    optim->cur_longopt = NULL;
-    optim->cur_count = 0;
-    optim->cur_arg = NULL;
+int optim_positionals_doubles(optim_t * optim, double * out, size_t n, size_t * parsed) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, -1);
+    if (!optim_positionals_typed(optim, parsed))
+        return -1;
 
-    struct optim_arg * last_arg = NULL;
+    for (size_t i = 0; i < n && optim->cur_count > 0; i++) {
+        const char * strarg = optim_pop_string(optim);
+        if (!optim_parse_double(strarg, &out[i])) {
+            optim_parse_error(optim, OPTIM_DIAG_BAD_NUMBER, strarg);
+            return -1;
+        }
+        if (parsed != NULL)
+            *parsed = i + 1;
+    }
+    return 0;
+}
 
-    for (size_t i = 0; i < optim->argc; i++) {
-        struct optim_arg * arg = &optim->args[i];
-        if (arg->used) continue;
-        if (arg->type != TYPE_BARE) continue;
+unsigned long optim_get_ulong(optim_t * optim, unsigned long empty) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, empty);
 
-        if (optim->cur_arg == NULL)
-            optim->cur_arg = arg;
-        if (last_arg != NULL)
-            last_arg->next = arg;
-        last_arg = arg;
-        optim->cur_count++;
+    const char * strarg = optim_get_typed(optim, __func__);
+    if (strarg == NULL) return empty;
+
+    unsigned long rc;
+    if (!optim_parse_ulong(strarg, &rc)) {
+        optim_parse_error(optim, OPTIM_DIAG_BAD_NUMBER, strarg);
+        return empty;
     }
+    return rc;
 }
 
-void optim_unused(optim_t * optim) {
-    if (optim == NULL) { OPTIM_INVALID; return; }
+double optim_get_double(optim_t * optim, double empty) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, empty);
 
-    if (optim->takes_unused)
-        return;
+    const char * strarg = optim_get_typed(optim, __func__);
+    if (strarg == NULL) return empty;
 
-    optim->takes_unused = true;
-    optim->cur_opt = '\0';
-    optim->cur_longopt = NULL;
-    optim->cur_count = 0;
-    optim->cur_arg = NULL;
+    double rc;
+    if (!optim_parse_double(strarg, &rc)) {
+        optim_parse_error(optim, OPTIM_DIAG_BAD_NUMBER, strarg);
+        return empty;
+    }
+    return rc;
+}
 
-    struct optim_arg * last_arg = NULL;
+uint64_t optim_get_size(optim_t * optim, uint64_t empty) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, empty);
 
-    for (size_t i = 0; i < optim->argc; i++) {
-        struct optim_arg * arg = &optim->args[i];
-        if (arg->used) continue;
+    const char * strarg = optim_get_typed(optim, __func__);
+    if (strarg == NULL) return empty;
 
-        // Rehydrate stripped forms
-        arg->arg = optim->argv[i];
-        if (arg->rhs != NULL)
-            arg->rhs[-1] = '=';
+    uint64_t rc;
+    if (!optim_parse_size(strarg, &rc)) {
+        optim_parse_error(optim, OPTIM_DIAG_BAD_SIZE, strarg);
+        return empty;
+    }
+    return rc;
+}
 
-        if (optim->cur_arg == NULL)
-            optim->cur_arg = arg;
-        if (last_arg != NULL)
-            last_arg->next = arg;
-        last_arg = arg;
-        optim->cur_count++;
+uint64_t optim_get_duration(optim_t * optim, uint64_t empty) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, empty);
+
+    const char * strarg = optim_get_typed(optim, __func__);
+    if (strarg == NULL) return empty;
+
+    uint64_t rc;
+    if (!optim_parse_duration(strarg, &rc)) {
+        optim_parse_error(optim, OPTIM_DIAG_BAD_DURATION, strarg);
+        return empty;
     }
+    return rc;
 }
 
-// -- Reading Options --
+// Create an instance for the arguments of a subcommand, allocated like `optim`
+// Returns `NULL` if out of memory
+static optim_t * optim_new_child(optim_t * optim) {
+    if (optim->arena == NULL) {
+        OPTIM_STAT(optim, allocations, 1);
+        return calloc(1, sizeof(struct optim));
+    }
 
-int optim_get_count(optim_t * optim) {
+    // Give the child half of what's left of the arena
+    struct optim_arena * arena = optim->arena;
+    size_t start = OPTIM_ALIGN(arena->used);
+    size_t len = start < arena->len ? (arena->len - start) / 2 : 0;
+    void * buf = len >= sizeof(struct optim) ? optim_alloc(optim, len) : NULL;
+    if (buf == NULL) {
+        if (optim->error == NULL)
+            optim->error = optim_arena_error_str;
+        return NULL;
+    }
+    return optim_new_arena(buf, len);
+}
+
+const char * optim_get_subcommand(optim_t * optim, optim_t ** child) {
     if (optim == NULL)
-        return (OPTIM_INVALID, -1);
+        return (OPTIM_INVALID, NULL);
 
-    if (optim->cur_count < 0)
-        optim_error(optim, "Internal optim error: `%s` called before `optim_arg`, `optim_flag`, `optim_positionals`, or `optim_unused`", __func__);
+    if (child != NULL)
+        *child = NULL;
+    if (optim->snapshot != NULL)
+        return NULL;
 
-    return optim->cur_count;
+    if (optim->subcommand == 0) {
+        // The subcommand is the first unused bare argument, before any "--"
+        size_t i = 1;
+        while (i < optim->config_start && optim->args[i].type != TYPE_SEP && (optim->args[i].used || optim->args[i].type != TYPE_BARE))
+            i++;
+        if (i == optim->config_start || optim->args[i].type == TYPE_SEP)
+            return NULL;
+
+        const char * name = optim->args[i].arg;
+        size_t decl = optim_trie_find(optim, name);
+        if (decl == 0) {
+            optim_report(optim, OPTIM_DIAG_UNKNOWN_COMMAND, &optim->args[i], '\0', NULL, name);
+            return NULL;
+        }
+
+        // The subcommand gets the rest of the arguments, except any already taken by options
+        OPTIM_CONSUMER(optim, decl);
+        for (size_t j = i; j < optim->config_start; j++) {
+            struct optim_arg * arg = &optim->args[j];
+            if (arg->used) {
+                optim->argv[j] = NULL;
+                continue;
+            }
+            if (arg->type == TYPE_LONG_ARG)
+                optim_rhs(arg)[-1] = '=';
+            optim_use(optim, arg);
+        }
+        OPTIM_STAT(optim, args_scanned, optim->config_start - 1);
+
+        // The child instance is reused after `optim_reset`
+        optim_t * sub = optim->child;
+        if (sub == NULL) {
+            sub = optim_new_child(optim);
+            if (sub == NULL) {
+                optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to allocate subcommand");
+                return NULL;
+            }
+            sub->parent = optim;
+            optim->child = sub;
+        } else {
+            optim_clear(sub);
+        }
+        OPTIM_PHASE_START(sub);
+        bool ok = optim_init(sub, optim->config_start - i, &optim->argv[i], optim->decls[decl - 1].metavar, NULL);
+        OPTIM_PHASE_END(sub, start_ns);
+        if (!ok) {
+            optim_text_error(optim, OPTIM_DIAG_INTERNAL, "Internal optim error: unable to allocate subcommand");
+            return NULL;
+        }
+        sub->complete_word = optim->complete_word;
+        optim->subcommand = decl;
+    }
+
+    if (child != NULL)
+        *child = optim->child;
+    return optim->decls[optim->subcommand - 1].longopt;
 }
 
-const char * optim_get_string(optim_t * optim, const char * empty) {
-    if (optim == NULL) { OPTIM_INVALID; return empty; }
+// -- Snapshots --
 
-    if (optim->cur_count < 0)  {
-        optim_error(optim, "Internal optim error: `%s` called before `optim_arg`, `optim_flag`, `optim_positionals`, or `optim_unused`", __func__);
-        return empty;
+// Position in a snapshot while it's laid out by `optim_snapshot_layout`
+struct optim_snapshot_layout {
+    char * out;                 // Where the snapshot is written, or NULL to only find its size
+    size_t record;              // Offset of the next record
+    size_t values;              // Offset of the offsets of the arguments
+    size_t value;               // Index of the next argument
+    size_t size;                // End of the strings so far
+};
+
+// Add `str` to the strings of the snapshot
+// Returns its offset
+static size_t optim_snapshot_string(struct optim_snapshot_layout * layout, const char * str) {
+    size_t off = layout->size;
+    size_t len = strlen(str) + 1;
+    if (layout->out != NULL)
+        memcpy(&layout->out[off], str, len);
+    layout->size += len;
+    return off;
+}
+
+// Add a record to the snapshot, with its `n` arguments from `taken`
+// Offsets past 4G are truncated, but then the snapshot is too big to be written
+static void optim_snapshot_record(struct optim_snapshot_layout * layout, uint8_t kind, const struct optim_decl * decl, const char * const * taken, size_t n) {
+    struct optim_snapshot_record record;
+    memset(&record, 0, sizeof record);
+    record.kind = kind;
+    record.values = (uint32_t) layout->value;
+    record.n_values = (uint32_t) n;
+    if (decl != NULL) {
+        record.opt = decl->opt;
+        record.has_arg = decl->metavar != NULL;
+        record.count = decl->count;
+        if (decl->longopt != NULL)
+            record.longopt = (uint32_t) optim_snapshot_string(layout, decl->longopt);
+    } else {
+        record.count = (int32_t) n;
     }
 
-    if (optim->cur_count == 0)
-        return empty;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t off = (uint32_t) optim_snapshot_string(layout, taken[i]);
+        if (layout->out != NULL)
+            memcpy(&layout->out[layout->values + layout->value * sizeof off], &off, sizeof off);
+        layout->value++;
+    }
+    if (layout->out != NULL)
+        memcpy(&layout->out[layout->record], &record, sizeof record);
+    layout->record += sizeof record;
+}
 
-    optim->cur_count--;
-    struct optim_arg * arg = optim->cur_arg;
-    optim->cur_arg = arg->next;
-    arg->used = true;
-    
-    if (optim->takes_unused)
-        return arg->arg;
+// Lay out the snapshot of the results, & write it to `out` unless it is NULL
+// Returns its size
+static size_t optim_snapshot_layout(optim_t * optim, char * out) {
+    struct optim_snapshot_header header = {
+        .magic = OPTIM_SNAPSHOT_MAGIC,
+        .version = OPTIM_SNAPSHOT_VERSION,
+    };
+    size_t n_values = 0;
+    for (size_t i = 0; i < optim->n_decls; i++) {
+        if (optim->decls[i].kind != DECL_OPTION) continue;
+        header.n_records++;
+        n_values += optim->decls[i].n_taken;
+    }
+    const struct optim_list * lists[] = {
+        optim->takes_positionals ? &optim->positionals : NULL,
+        optim->takes_unused ? &optim->unused : NULL,
+    };
+    for (size_t i = 0; i < 2; i++) {
+        if (lists[i] == NULL) continue;
+        header.n_records++;
+        n_values += lists[i]->n;
+    }
+    header.n_values = (uint32_t) n_values;
 
-    switch (arg->type) {
-    case TYPE_BARE:
-        return arg->arg;
-    case TYPE_LONG_ARG:
-        return arg->rhs;
-    case TYPE_NONE:
-    case TYPE_INVOC:
-    case TYPE_FLAGS:
-    case TYPE_LONG:
-    case TYPE_SEP:
-        break;
+    struct optim_snapshot_layout layout = { .out = out, .record = sizeof header };
+    layout.values = layout.record + header.n_records * sizeof(struct optim_snapshot_record);
+    layout.size = layout.values + n_values * sizeof(uint32_t);
+    for (size_t i = 0; i < optim->n_decls; i++) {
+        const struct optim_decl * decl = &optim->decls[i];
+        if (decl->kind != DECL_OPTION) continue;
+        optim_snapshot_record(&layout, SNAPSHOT_OPTION, decl, &optim->taken[decl->taken], decl->n_taken);
     }
+    if (lists[0] != NULL)
+        optim_snapshot_record(&layout, SNAPSHOT_POSITIONALS, NULL, &optim->taken[lists[0]->taken], lists[0]->n);
+    if (lists[1] != NULL)
+        optim_snapshot_record(&layout, SNAPSHOT_UNUSED, NULL, &optim->taken[lists[1]->taken], lists[1]->n);
 
-    // There was a logic error if we get here
-    assert(0);
-    optim_error(optim, "Internal optim error: `%s` unable to handle argument type '%d'", __func__, arg->type);
-    return empty;
+    if (out != NULL) {
+        header.size = (uint32_t) layout.size;
+        header.hash = optim_hash64(OPTIM_HASH64_INIT, &out[sizeof header], layout.size - sizeof header);
+        memcpy(out, &header, sizeof header);
+    }
+    return layout.size;
 }
 
-long optim_get_long(optim_t * optim, long empty) {
+size_t optim_snapshot(optim_t * optim, void * buf, size_t len) {
     if (optim == NULL)
-        return (OPTIM_INVALID, empty);
+        return (OPTIM_INVALID, 0);
 
-    if (optim->cur_count < 0) {
-        optim_error(optim, "Internal optim error: `%s` called before `optim_arg`, `optim_flag`, `optim_positionals`, or `optim_unused`", __func__);
-        return empty;
-    }
+    // Errors, subcommands & streams can't be replayed
+    if (optim_failed(optim) || optim->snapshot != NULL)
+        return (errno = EINVAL, 0);
+    if (optim->subcommand != 0 || (optim->stream != NULL && optim->stream->active))
+        return (errno = ENOTSUP, 0);
+    if ((optim->takes_positionals && !optim_copy_list(optim, &optim->positionals)) ||
+            (optim->takes_unused && !optim_copy_list(optim, &optim->unused)))
+        return (errno = ENOMEM, 0);
 
-    const char * strarg = optim_get_string(optim, NULL);
-    if (strarg == NULL) return empty;
+    // Offsets in the snapshot are 32 bits
+    size_t size = optim_snapshot_layout(optim, NULL);
+    if (size > UINT32_MAX)
+        return (errno = E2BIG, 0);
+    if (buf != NULL && len >= size)
+        optim_snapshot_layout(optim, buf);
+    return size;
+}
 
-    char * p = NULL;
-    long rc = strtol(strarg, &p, 0);
-    if (strarg[0] == '\0' || p == NULL || p[0] != '\0') {
-        optim_error(optim, "Unable to parse number '%s'", strarg);
-        return empty;
+// Check that everything in `snapshot` is in bounds, & that it hasn't changed since it was written
+static bool optim_snapshot_valid(const char * snapshot, size_t len) {
+    struct optim_snapshot_header header;
+    if (snapshot == NULL || (uintptr_t) snapshot % sizeof(uint64_t) != 0 || len < sizeof header)
+        return false;
+    memcpy(&header, snapshot, sizeof header);
+    if (memcmp(header.magic, OPTIM_SNAPSHOT_MAGIC, sizeof header.magic) != 0 || header.version != OPTIM_SNAPSHOT_VERSION)
+        return false;
+    if (header.size < sizeof header || header.size > len)
+        return false;
+    if (header.hash != optim_hash64(OPTIM_HASH64_INIT, &snapshot[sizeof header], header.size - sizeof header))
+        return false;
+
+    size_t size = header.size;
+    size_t values = sizeof header + (size_t) header.n_records * sizeof(struct optim_snapshot_record);
+    size_t strings = values + (size_t) header.n_values * sizeof(uint32_t);
+    if (strings > size || (strings < size && snapshot[size - 1] != '\0'))
+        return false;
+
+    const struct optim_snapshot_record * records = (const void *) &snapshot[sizeof header];
+    for (size_t i = 0; i < header.n_records; i++) {
+        const struct optim_snapshot_record * record = &records[i];
+        if (record->kind > SNAPSHOT_UNUSED || record->count < 0)
+            return false;
+        if (record->values > header.n_values || record->n_values > header.n_values - record->values)
+            return false;
+        if (record->longopt != 0 && (record->longopt < strings || record->longopt >= size))
+            return false;
     }
-    return rc;
+    const uint32_t * offsets = (const void *) &snapshot[values];
+    for (size_t i = 0; i < header.n_values; i++) {
+        if (offsets[i] < strings || offsets[i] >= size)
+            return false;
+    }
+    return true;
+}
+
+optim_t * optim_from_snapshot(const void * snapshot, size_t len) {
+    if (!optim_snapshot_valid(snapshot, len))
+        return (errno = EINVAL, NULL);
+
+    struct optim * optim = calloc(1, sizeof *optim);
+    if (optim == NULL) return NULL;
+    OPTIM_STAT(optim, allocations, 1);
+
+    const struct optim_snapshot_header * header = snapshot;
+    optim->snapshot = snapshot;
+    optim->snapshot_records = (const void *) &optim->snapshot[sizeof *header];
+    optim->snapshot_n_records = header->n_records;
+    optim->snapshot_values = (const void *) &optim->snapshot_records[header->n_records];
+    optim->cur_count = -1;
+    return optim;
 }
 
 // -- Error Handling & Usage --
@@ -647,16 +4518,32 @@ int optim_usage(optim_t * optim, const char * fmt, ...) {
     if (optim == NULL)
         return (OPTIM_INVALID, -1);
 
-    if (optim->usage_rc < 0)
-        return optim->usage_rc;
+    // A snapshot has no usage message to print
+    if (optim->snapshot != NULL)
+        return 0;
+
+    struct optim_decl * decl = optim_push_decl(optim);
+    if (decl == NULL)
+        return -1;
+    decl->kind = DECL_TEXT;
+
+    // Most usage text has nothing to interpolate, so it can be used as-is
+    if (strchr(fmt, '%') == NULL) {
+        decl->help = fmt;
+        return (int) strlen(fmt);
+    }
 
+    // Interpolated text is appended to `usage_text`, which may move as it grows
     va_list args;
     va_start(args, fmt);
-    int rc = vfprintf(optim->usage, fmt, args);
+    int rc = optim_vformat(optim, &optim->usage_text, &optim->usage_text_cap, optim->usage_text_len, fmt, args);
     va_end(args);
+    if (rc < 0)
+        return (optim->n_decls--, -1);
 
-    if (rc < 0) optim->usage_rc = rc;
-
+    decl->pooled = true;
+    decl->text = optim->usage_text_len;
+    optim->usage_text_len += (size_t) rc + 1;
     return rc;
 }
 
@@ -664,58 +4551,58 @@ int optim_error(optim_t * optim, const char * fmt, ...) {
     if (optim == NULL)
         return (OPTIM_INVALID, -1);
 
-    if (optim->error != NULL)
-        return 0;
-
     va_list args;
     va_start(args, fmt);
-    int rc = vsnprintf(NULL, 0, fmt, args);
+    int rc = optim_verror(optim, OPTIM_DIAG_ERROR, fmt, args);
     va_end(args);
-    if (rc < 0)
-        return (optim->error = optim_bad_error_str, -1);
+    return rc;
+}
 
-    size_t size = ((size_t) rc) + 1;
-    optim->error = calloc(1, size);
-    if (optim->error == NULL)
-        return (optim->error = optim_bad_error_str, -1);
+const struct optim_diag * optim_next_diag(optim_t * optim, size_t * iter) {
+    if (optim == NULL || iter == NULL)
+        return (OPTIM_INVALID, NULL);
 
-    va_start(args, fmt);
-    rc = vsnprintf(optim->error, size, fmt, args);
-    va_end(args);
-    if (rc < 0)
-        return (free(optim->error), optim->error = optim_bad_error_str, -1);
+    if (*iter >= optim->n_diags)
+        return NULL;
+    struct optim_report * report = &optim->diags[(*iter)++];
+    // `diag_text` may have moved since it was recorded
+    struct optim_diag * diag = &report->diag;
+    if (report->pooled && (diag->code == OPTIM_DIAG_ERROR || diag->code == OPTIM_DIAG_INTERNAL || diag->code == OPTIM_DIAG_STREAM || diag->code == OPTIM_DIAG_QUOTING))
+        diag->text = &optim->diag_text[report->text];
+    else if (report->pooled)
+        diag->value = &optim->diag_text[report->text];
+    return diag;
+}
 
-    // Delete trailing newline
-    if (rc > 0 && optim->error[rc-1] == '\n')
-        optim->error[rc-1] = '\0';
+int optim_format_diag(const struct optim_diag * diag, char * buf, size_t len) {
+    if (diag == NULL || (buf == NULL && len > 0))
+        return (errno = EINVAL, -1);
 
-    return rc;
+    if (len > 0)
+        buf[0] = '\0';
+    return optim_diag_message(diag, NULL, buf, len);
 }
 
 int optim_version(optim_t * optim, const char * fmt, ...) {
     if (optim == NULL)
         return (OPTIM_INVALID, -1);
 
-    if (optim->version != NULL)
+    if (optim->has_version)
         return -1;
+    // `--version` can't have been given, so the text is never printed
+    if (optim->snapshot != NULL) {
+        optim->has_version = true;
+        optim_flag(optim, '\0', "version", "Print version information");
+        return 0;
+    }
 
     va_list args;
     va_start(args, fmt);
-    int rc = vsnprintf(NULL, 0, fmt, args);
+    int rc = optim_vformat(optim, &optim->version, &optim->version_cap, 0, fmt, args);
     va_end(args);
     if (rc < 0)
         return -1;
-
-    size_t size = ((size_t) rc) + 1;
-    optim->version = calloc(1, size);
-    if (optim->version == NULL)
-        return (optim->version = NULL, -1);
-
-    va_start(args, fmt);
-    rc = vsnprintf(optim->version, size, fmt, args);
-    va_end(args);
-    if (rc < 0)
-        return (free(optim->version), optim->version= NULL, -1);
+    optim->has_version = true;
 
     optim_flag(optim, '\0', "version", "Print version information");
     if (optim_get_count(optim) > 0)
@@ -723,3 +4610,70 @@ int optim_version(optim_t * optim, const char * fmt, ...) {
 
     return rc;
 }
+
+void optim_static(optim_t * optim, const struct optim_static * text) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    optim->static_text = text;
+}
+
+// -- Debugging --
+
+int optim_stats(optim_t * optim, struct optim_stats * stats) {
+    if (optim == NULL)
+        return (OPTIM_INVALID, -1);
+    if (stats == NULL)
+        return (errno = EINVAL, -1);
+
+#ifdef OPTIM_STATS
+    *stats = optim->stats;
+    return 0;
+#else
+    memset(stats, 0, sizeof *stats);
+    return (errno = ENOSYS, -1);
+#endif
+}
+
+void optim_debug(optim_t * optim) {
+    if (optim == NULL) { OPTIM_INVALID; return; }
+
+    static const char * const type_names[] = {
+        [TYPE_NONE] = "NONE",
+        [TYPE_INVOC] = "INVOC",
+        [TYPE_BARE] = "BARE",
+        [TYPE_FLAGS] = "FLAGS",
+        [TYPE_LONG] = "LONG",
+        [TYPE_LONG_ARG] = "LONG_ARG",
+        [TYPE_SEP] = "SEP",
+    };
+
+    fprintf(stderr, "optim: %zu args\n", optim->argc);
+    for (size_t i = 0; i < optim->argc; i++) {
+        const struct optim_arg * arg = &optim->args[i];
+        fprintf(stderr, "  %3zu %-8s %-6s '%s'", i, type_names[arg->type], arg->used ? "used" : "unused", arg->arg != NULL ? arg->arg : "");
+        if ((arg->type == TYPE_LONG_ARG || arg->type == TYPE_FLAGS) && arg->rhs != 0)
+            fprintf(stderr, " = '%s'", optim_rhs(arg));
+        if (arg->prefix)
+            fprintf(stderr, " (prefix)");
+        if (i >= optim->config_start) {
+            const struct optim_config_line * where = &optim->config_lines[i - optim->config_start];
+            fprintf(stderr, " (%s:%zu)", where->path, where->line);
+        }
+#ifdef OPTIM_STATS
+        if (arg->used_by == OPTIM_BY_POSITIONALS) {
+            fprintf(stderr, " by positionals");
+        } else if (arg->used_by == OPTIM_BY_UNUSED) {
+            fprintf(stderr, " by unused");
+        } else if (arg->used_by != 0 && arg->used_by <= optim->n_decls) {
+            const struct optim_decl * decl = &optim->decls[arg->used_by - 1];
+            if (decl->kind == DECL_SUBCOMMAND)
+                fprintf(stderr, " by command '%s'", decl->longopt);
+            else if (decl->longopt != NULL)
+                fprintf(stderr, " by '--%s'", decl->longopt);
+            else
+                fprintf(stderr, " by '-%c'", decl->opt);
+        }
+#endif
+        fprintf(stderr, "\n");
+    }
+}
@@ -5,21 +5,82 @@
 // Released under MIT License
 // Copyright (c) 2017 Zach Banks
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct optim optim_t;
 
 // Create an optim instance from `argc` and `argv`
 // `usage` is a one-line description how to invoke the program
 // and will be prefixed with the basename. Do not end in '\n'
 // optim will take ownership of `argv`, and may modify its contents
+// The usage message is only formatted if it is printed by `optim_finish`, so
+// `usage` and all strings passed to the `optim_arg` & `optim_flag` declarations
+// must remain valid until `optim_finish` is called
 optim_t * optim_start(int argc, char ** argv, const char * usage); 
 
+// Create an optim instance like `optim_start`, also expanding response files
+// Arguments of the form `@path` (before any `--`) are replaced by the contents of
+// the response file at `path`, one argument per line. If it isn't readable, `@path` is kept as-is.
+// Don't use this in a program which runs with more privileges than its caller, since it reads any
+// file it is given, and its lines can be shown in errors. `optim_reset` also expands them.
+optim_t * optim_start_expand(int argc, char ** argv, const char * usage);
+
+// Create an optim instance like `optim_start`, with the arguments read from the file at `path`
+// `invocation` is used in place of `argv[0]`
+// The file has one argument per line, and is mapped rather than read into memory
+// Returns `NULL` and sets `errno` if the file can't be read
+optim_t * optim_start_file(char * invocation, const char * path, const char * usage);
+
+// Create an optim instance like `optim_start`, from the command line in the string `buf`, e.g. one
+// read from a socket. It is split into words in place, like a shell would: by whitespace, with '...'
+// & "..." quotes and `\` escapes; the first word is used as the invocation. The string ends after
+// `len` bytes, or at a NUL. `buf` is modified, & must remain valid until `optim_finish` is called.
+// No files are read for `@path` arguments, & `--optim-*` arguments are not special.
+// A missing quote (or a trailing `\`) is an error, reported with its byte offset by `optim_finish`.
+// Returns `NULL` and sets `errno` if out of memory
+optim_t * optim_start_string(char * buf, size_t len, const char * usage);
+
+// Create an optim instance like `optim_start`, without using the heap
+// All of optim's state, including error & version text, is allocated from the
+// `buflen` bytes at `buf`. Returns `NULL` if `buf` is too small to hold the parsed
+// arguments; if it runs out of space later, the error "arena exhausted" is reported.
+// `buf` must remain valid until `optim_finish` is called, and is not freed by it.
+optim_t * optim_start_arena(int argc, char ** argv, const char * usage, void * buf, size_t buflen);
+
 // Finish parsing the options & destroy `*optim_p`, setting it to NULL
 // Returns `0` on success, `-1` on error, and `1` if usage was printed.
 // Your program should exit(EXIT_FAILURE) if the return is non-zero.
 int optim_finish(optim_t ** optim_p);
 
+// Finish parsing the options like `optim_finish`, but keep the instance so that it
+// can be reused with `optim_reset`. Returns the same values as `optim_finish`.
+int optim_end(optim_t * optim);
+
+// Start parsing a new `argc` and `argv` with an existing instance, reusing its buffers
+// All state from the previous arguments is discarded; `usage` is kept from `optim_start`.
+// Buffers only grow when the new arguments need more room, so repeatedly parsing
+// similar arguments does not allocate. Returns `0` on success, or `-1` if out of memory.
+// Separate instances share no state, and can be used concurrently from different threads.
+int optim_reset(optim_t * optim, int argc, char ** argv);
+
+// Add the options in the config file at `path` to the arguments, as if they were on the command line
+// Each line is `name = value` for the long option `--name`, or `name` for a flag; flags can also be
+// set to a boolean (`true`, `false`, `1`, `0`, ...). Blank lines, `#` & `;` comments, and `[section]`
+// headers are skipped. Options given on the command line take precedence over the config file.
+// The file is mapped rather than read into memory, & `path` must remain valid until `optim_finish`.
+// Must be called before any options are declared. Returns `0` on success, or `-1` and sets `errno`
+// if the file can't be read or has errors. Errors in the file are reported with its `path:line`.
+int optim_config_file(optim_t * optim, const char * path);
+
 // -- Declaring Options --
 
+// Long options on the command line can be abbreviated to any prefix of their name (`--verb`
+// for `--verbose`), which is an error from `optim_finish` if it is a prefix of more than one
+// declared long option. The whole name of a declared long option is given to that option. If an
+// option declared before it has already taken the name as an abbreviation (`--verb`, with `--verbose`
+// declared before `--verb`), both have it, & `optim_finish` reports it as ambiguous.
+
 // Delcare an option that takes a required argument
 // `opt`        - 1-letter short option (-l), or `\0` for long-only
 // `longopt`    - long option (--long), or `NULL` for short-only
@@ -33,10 +94,53 @@ void optim_arg(optim_t * optim, char opt, const char * longopt, const char * met
 // `help`       - usage message, can contain newlines
 void optim_flag(optim_t * optim, char opt, const char * longopt, const char * help);
 
+// Fall back to the environment variable `name` for the option just declared with
+// `optim_arg` or `optim_flag`, if it was not given on the command line
+// Flags are set by any value other than "", "0", or "false". `name` is shown in the usage message.
+void optim_env(optim_t * optim, const char * name);
+
+// Only index the environment variables starting with `prefix` (e.g. "MYAPP_") for `optim_env`
+// The environment is indexed once, by the first call to `optim_env`; other names are found with `getenv`
+// Must be called before `optim_env`. `prefix` is kept by `optim_reset`.
+void optim_env_prefix(optim_t * optim, const char * prefix);
+
+// Declare a subcommand (e.g. `git show`), which takes the arguments after it
+// `name`       - name of the subcommand
+// `usage`      - one-line description of how to invoke the subcommand, like for `optim_start`
+// `help`       - usage message, can contain newlines
+// All subcommands should be declared before `optim_get_subcommand`
+void optim_subcommand(optim_t * optim, const char * name, const char * usage, const char * help);
+
+// Entry in a table of options for `optim_parse_table`
+struct optim_option {
+    char opt;                   // 1-letter short option (-l), or `\0` for long-only
+    const char * longopt;       // long option (--long), or `NULL` for short-only
+    const char * metavar;       // name of the argument in usage, or `NULL` if it does not take one
+    const char * help;          // usage message, can contain newlines
+    int * count;                // If not `NULL`, set to the number of times the option was given
+    const char ** value;        // If not `NULL`, set to the last argument given (left as-is if none)
+};
+
+// Declare all `n` options in `table` at once, like calling `optim_arg` (or `optim_flag`, if
+// `metavar` is `NULL`) for each entry, but with a single pass over the arguments
+// The results are written to the `count` and `value` slots of each entry, instead of being
+// read with `optim_get_*`. The usage message & errors are the same as for `optim_arg` & `optim_flag`.
+// An entry with neither `opt` nor `longopt` adds its `help` to the usage message, like `optim_usage`
+// `table` must remain valid until `optim_finish` is called
+void optim_parse_table(optim_t * optim, const struct optim_option * table, size_t n);
+
 // Take positional arguments
 // This function should only be called after all other `optim_arg` and `optim_flag`s
 void optim_positionals(optim_t * optim);
 
+// Take positional arguments like `optim_positionals`, followed by more read from `fd`
+// The positionals in `fd` are separated by `delim` (e.g. '\0' for `find -print0`), and are
+// read on demand through a fixed-size buffer, so they never all need to be in memory.
+// Once the positionals from `argv` run out, `optim_get_count` is 1 while there are more to read.
+// Each positional from `fd` is only valid until the next `optim_get_count` or `optim_get_string`.
+// `fd` is not closed by optim.
+void optim_positionals_stream(optim_t * optim, int fd, char delim);
+
 // Take unused/invalid arguments
 // This function should only be called after you've used all other arguments
 // If you consume an argument with `optim_get_string`, optim will consider it used
@@ -57,17 +161,129 @@ const char * optim_get_string(optim_t * optim, const char * empty);
 // Returns `empty` if it is not available (or there is a parse error)
 long optim_get_long(optim_t * optim, long empty);
 
+// Get the argument to the current option as an unsigned long
+// Returns `empty` if it is not available (or there is a parse error)
+unsigned long optim_get_ulong(optim_t * optim, unsigned long empty);
+
+// Get the argument to the current option as a double
+// Returns `empty` if it is not available (or there is a parse error)
+double optim_get_double(optim_t * optim, double empty);
+
+// Get the argument to the current option as a size in bytes, with an optional
+// binary suffix (`64K`, `2G`, `1MiB`, ...)
+// Returns `empty` if it is not available (or there is a parse error)
+uint64_t optim_get_size(optim_t * optim, uint64_t empty);
+
+// Get the argument to the current option as a duration in nanoseconds
+// Units are `ns`, `us`, `ms`, `s`, `m`, `h` & `d`, and can be combined (`250ms`, `1h30m`, `1.5s`)
+// A number without a unit is in seconds
+// Returns `empty` if it is not available (or there is a parse error)
+uint64_t optim_get_duration(optim_t * optim, uint64_t empty);
+
+// Get up to `n` of the remaining arguments to the current option as strings
+// The strings are not copied, and positionals from a stream are not included
+// Returns the number of strings written to `out`
+size_t optim_get_strings(optim_t * optim, const char ** out, size_t n);
+
+// Get up to `n` of the remaining arguments to the current option as longs
+// Stops at the first argument which can't be parsed
+// Returns the number of longs written to `out`
+size_t optim_get_longs(optim_t * optim, long * out, size_t n);
+
+// Take positional arguments like `optim_positionals`, and convert up to `n` of them to numbers in `out`
+// The whole list is converted in one pass; plain decimal numbers are parsed 8 digits at a time.
+// Other forms are parsed like `optim_get_long` (`optim_get_ulong` & `optim_get_double`).
+// Positionals after the first `n`, or from a stream, are left for `optim_get_*`.
+// `*parsed` (if not `NULL`) is set to the number converted, which is the index of the first bad one
+// Returns `0`, or `-1` if one couldn't be parsed (which is also reported as an error)
+int optim_positionals_longs(optim_t * optim, long * out, size_t n, size_t * parsed);
+int optim_positionals_uint64s(optim_t * optim, uint64_t * out, size_t n, size_t * parsed);
+int optim_positionals_doubles(optim_t * optim, double * out, size_t n, size_t * parsed);
+
+// Get the subcommand given on the command line, or `NULL` if there isn't one
+// The subcommand is the first positional argument before any `--`; it is an error if it
+// isn't one of the declared subcommands. The arguments after it are not seen by `optim`, and
+// are instead parsed by `*child`, a new instance just for the subcommand's options.
+// `*child` is finished along with `optim`, and must not be passed to `optim_finish` itself.
+// Call this before declaring any other options, so that they only see the arguments before the subcommand.
+const char * optim_get_subcommand(optim_t * optim, optim_t ** child);
+
+// -- Snapshots --
+
+// Write the results of the parse (the count & arguments of every option, the positionals, and the
+// unused args) to `buf` as a flat snapshot, which has no pointers and can be mapped at any address
+// Returns the size of the snapshot, which is only written if it fits in `len`, so call it with
+// `len = 0` first to size a buffer (e.g. a `memfd` shared with forked workers).
+// Returns `0` and sets `errno` if there were errors, a subcommand was taken, or positionals are streamed.
+// Call it after all the declarations, but before `optim_finish`.
+size_t optim_snapshot(optim_t * optim, void * buf, size_t len);
+
+// Create a read-only instance which replays the results in `snapshot` from `optim_snapshot`
+// The same declarations must be made in the same order, but the arguments are not parsed again:
+// `optim_get_*` return the strings in `snapshot`, which must stay mapped until `optim_finish`.
+// Nothing is allocated other than the instance. `optim_env`, `optim_config_file` & `optim_usage`
+// have no effect, and there is no usage message or subcommand. `snapshot` must be 8-byte aligned.
+// Returns `NULL` and sets `errno` to `EINVAL` if `snapshot` is corrupt or from another version of optim.
+// Declarations which don't match the snapshot are reported as errors.
+optim_t * optim_from_snapshot(const void * snapshot, size_t len);
+
 // -- Error Handling & Usage --
 
 // Declare an error
-// If there are any errors, the first error message is printed, followed by the usage
+// If there are any errors, every error message is printed, followed by the usage
 // and `optim_finish` will return `-1` when called.
 // The error message supports printf-style string interpolation.
 __attribute__ ((format (printf, 2, 3)))
 int optim_error(optim_t * optim, const char * format, ...);
 
+// Kinds of errors, for `struct optim_diag`
+enum optim_diag_code {
+    OPTIM_DIAG_ERROR,               // From `optim_error`
+    OPTIM_DIAG_INTERNAL,            // optim was used incorrectly, or ran out of memory
+    OPTIM_DIAG_MISSING_ARG,         // `-a` or `--alpha` without its argument
+    OPTIM_DIAG_UNEXPECTED_ARG,      // `--verbose=ARG`, for a flag
+    OPTIM_DIAG_NOT_BOOL,            // A flag in a config file set to something other than a boolean
+    OPTIM_DIAG_AMBIGUOUS,           // A prefix of more than one long option
+    OPTIM_DIAG_UNUSED_POSITIONAL,
+    OPTIM_DIAG_UNUSED_FLOATING,     // A bare argument, without `optim_positionals`
+    OPTIM_DIAG_UNUSED_FLAG,         // A letter in a set of short flags
+    OPTIM_DIAG_UNUSED_OPTION,       // A long option
+    OPTIM_DIAG_BAD_NUMBER,          // From the typed getters
+    OPTIM_DIAG_BAD_SIZE,
+    OPTIM_DIAG_BAD_DURATION,
+    OPTIM_DIAG_UNKNOWN_COMMAND,
+    OPTIM_DIAG_CONFIG_SYNTAX,       // A line in a config file that isn't `name = value`
+    OPTIM_DIAG_STREAM,              // Reading from `optim_positionals_stream` failed
+    OPTIM_DIAG_TAKEN_ARG,           // `-aARG`, when letters of `ARG` were already used as flags
+    OPTIM_DIAG_QUOTING,             // A missing quote or trailing `\` in the string of `optim_start_string`
+};
+
+// An error, recorded as it happens but only formatted when it's printed
+// The strings point into the arguments & declarations, so they're valid until `optim_finish` or `optim_reset`
+struct optim_diag {
+    enum optim_diag_code code;
+    size_t index;                   // Index of the argument in `argv` (after response files), or 0
+    const char * path;              // Config file & line the argument is from, or `NULL`
+    size_t line;
+    char opt;                       // Option the error is about, if any
+    const char * longopt;
+    const char * value;             // Argument or value which is wrong, or `NULL`
+    const char * alt;               // Another long option an ambiguous prefix could be
+    const char * text;              // Message of `OPTIM_DIAG_ERROR`, `_INTERNAL`, `_STREAM` & `_QUOTING`
+};
+
+// Iterate over every error so far, in the order they were reported; `*iter` starts at 0
+// Returns `NULL` after the last. The errors found by `optim_end` are only included after it is called.
+const struct optim_diag * optim_next_diag(optim_t * optim, size_t * iter);
+
+// Format the message of `diag` into `buf`, like `snprintf`, as `optim_finish` would print it
+// Returns the length of the message, or `-1` on error
+int optim_format_diag(const struct optim_diag * diag, char * buf, size_t len);
+
 // Add text to the usage message
+// Option help is wrapped to the width of the terminal (or `$COLUMNS`, or 80), but this text is not
 // The message supports printf-style string interpolation.
+// If there is nothing to interpolate, `format` is used without copying it.
 __attribute__ ((format (printf, 2, 3)))
 int optim_usage(optim_t * optim, const char * format, ...);
 
@@ -76,4 +292,57 @@ int optim_usage(optim_t * optim, const char * format, ...);
 __attribute__ ((format (printf, 2, 3)))
 int optim_version(optim_t * optim, const char * format, ...);
 
+// Usage & version messages formatted at build time, for `optim_static`
+// If optim is built with `-DOPTIM_GENERATE`, running the program with `--optim-generate-c=PATH` as
+// its first argument goes through the declarations as usual, then `optim_finish` writes a C file to
+// `PATH` defining `const struct optim_static optim_static_<name>` (with `--optim-generate-man=PATH`,
+// it writes a man page instead, like `help2man`). Any other arguments & errors are ignored, and it
+// returns `1`. Only link that build into the program run at build time, since it writes to any `PATH`.
+struct optim_static {
+    uint64_t hash;              // Hash of the declarations the text was generated from
+    const char * usage;         // The whole usage message
+    size_t usage_len;
+    const char * version;       // `--version` message, or `NULL`
+    size_t version_len;
+};
+
+// Print the usage message from `text` (made by `--optim-generate-c`) instead of formatting it
+// If the declarations, usage, version, or program name no longer match, it is formatted as usual
+// Generated text is always wrapped to 80 columns, rather than to the width of the terminal
+// `text` is kept by `optim_reset`
+void optim_static(optim_t * optim, const struct optim_static * text);
+
+// Shell completion
+// Running the program with `--optim-complete <cword> <words...>` as its first arguments, where `words` is
+// the command line being completed, starting with the program (`COMP_WORDS` in bash), and `cword` is the
+// index of the word under the cursor (`COMP_CWORD`), goes through the declarations with only the words
+// before the cursor. Then, instead of formatting any usage, `optim_finish` prints the candidates for the
+// word, one per line, and returns `1`. They are the matching options (after `-` or `--`) or subcommands;
+// the line `:metavar NAME` means the word is the argument of an option, and `:positional` that it can be a
+// positional, so the shell can complete file names. Config files & `fd` positionals aren't read, and any
+// errors are ignored.
+
+// -- Debugging --
+
+// Counters for `optim_stats`, only collected if optim is compiled with `-DOPTIM_STATS`
+struct optim_stats {
+    size_t args_scanned;        // Arguments looked at, by each pass over them
+    size_t strcmps;             // String comparisons in option lookups
+    size_t flagpops;            // Uses of letters from a set of short flags (`-abc`)
+    size_t allocations;         // Allocations, from the heap or the arena
+    size_t usage_bytes;         // Bytes of usage message printed
+    uint64_t start_ns;          // Time spent in `optim_start` (or `optim_reset`)
+    uint64_t declare_ns;        // Time spent in `optim_arg`, `optim_flag`, `optim_positionals`, ...
+    uint64_t finish_ns;         // Time spent in `optim_end`
+};
+
+// Get the counters since `optim_start` (or `optim_reset`) in `*stats`
+// Call `optim_end` first to include it, since `optim_finish` destroys the instance
+// Returns `0` on success, or `-1` and sets `errno` to `ENOSYS` if optim was compiled without `OPTIM_STATS`
+int optim_stats(optim_t * optim, struct optim_stats * stats);
+
+// Print every argument to stderr, with its type & whether it has been used yet
+// If optim is compiled with `OPTIM_STATS`, also print which declaration used it
+void optim_debug(optim_t * optim);
+
 #endif
@@ -0,0 +1,390 @@
+#include <assert.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "optim.h"
+
+// Microbenchmark: time `optim_start` through `optim_finish` against an
+// equivalent `getopt_long` loop over a matrix of argument shapes.
+//
+// Each (shape, parser) pair runs in a forked child so that its peak RSS
+// can be measured on its own.
+
+// -- Allocation counting --
+
+// Interpose the allocator so calls from liboptim.so & libc are counted too
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t n, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+
+static size_t n_allocs;
+
+void * malloc(size_t size) {
+    n_allocs++;
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t n, size_t size) {
+    n_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void * realloc(void * ptr, size_t size) {
+    n_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+// -- Argument generation --
+
+enum shape {
+    SHAPE_LONG_EQ,              // --option-N=VAL
+    SHAPE_LONG_SEP,             // --option-N VAL
+    SHAPE_CLUSTERS,             // -acg -eik ...
+    SHAPE_REPEATED,             // -b VAL --option-1=VAL ...
+    SHAPE_POSITIONAL,           // file0 file1 ... with a few --option-N=VAL
+    SHAPE_MAX,
+};
+
+static const char * shape_names[SHAPE_MAX] = {
+    [SHAPE_LONG_EQ] = "long=val",
+    [SHAPE_LONG_SEP] = "long val",
+    [SHAPE_CLUSTERS] = "clusters",
+    [SHAPE_REPEATED] = "repeated",
+    [SHAPE_POSITIONAL] = "positional",
+};
+
+// Short letters for the first options; 'h' is taken by optim's `--help`
+static const char short_letters[] = "abcdefgijklmnopqrstuvwxyzABCDEFGIJKLMNOPQRSTUVWXYZ";
+#define N_SHORT (sizeof short_letters - 1)
+
+struct bench {
+    enum shape shape;
+    size_t argc;
+    size_t n_opts;
+
+    char ** longopts;           // Name of each option; even options are flags, odd take an argument
+    char * pool;                // Template argument strings
+    size_t pool_len;
+    size_t * offsets;           // Offset of each argument in `pool`
+
+    char * work;                // Copy of `pool` that the parser may modify
+    char ** argv;               // Pointers into `work`
+};
+
+static bool opt_takes_arg(size_t i) {
+    return i % 2 == 1;
+}
+
+static char opt_short(size_t i) {
+    return i < N_SHORT ? short_letters[i] : '\0';
+}
+
+static void bench_push(struct bench * b, size_t * cap, size_t * n, const char * str) {
+    size_t len = strlen(str) + 1;
+    while (b->pool_len + len > *cap) {
+        *cap *= 2;
+        b->pool = realloc(b->pool, *cap);
+        assert(b->pool != NULL);
+    }
+    memcpy(b->pool + b->pool_len, str, len);
+    b->offsets[(*n)++] = b->pool_len;
+    b->pool_len += len;
+}
+
+static void bench_generate(struct bench * b) {
+    b->longopts = calloc(b->n_opts, sizeof *b->longopts);
+    assert(b->longopts != NULL);
+    for (size_t i = 0; i < b->n_opts; i++) {
+        char name[32];
+        snprintf(name, sizeof name, "option-%zu", i);
+        b->longopts[i] = strdup(name);
+        assert(b->longopts[i] != NULL);
+    }
+
+    size_t cap = 1 << 16;
+    b->pool = malloc(cap);
+    b->offsets = calloc(b->argc + 1, sizeof *b->offsets);
+    assert(b->pool != NULL && b->offsets != NULL);
+    b->pool_len = 0;
+
+    size_t n = 0;
+    bench_push(b, &cap, &n, "bench");
+
+    char buf[64];
+    size_t k = 0;
+    while (n < b->argc) {
+        size_t i = k % b->n_opts;
+        size_t left = b->argc - n;
+        switch (b->shape) {
+        case SHAPE_LONG_EQ:
+            if (opt_takes_arg(i))
+                snprintf(buf, sizeof buf, "--%s=%zu", b->longopts[i], k);
+            else
+                snprintf(buf, sizeof buf, "--%s", b->longopts[i]);
+            bench_push(b, &cap, &n, buf);
+            break;
+        case SHAPE_LONG_SEP:
+            if (opt_takes_arg(i) && left >= 2) {
+                snprintf(buf, sizeof buf, "--%s", b->longopts[i]);
+                bench_push(b, &cap, &n, buf);
+                snprintf(buf, sizeof buf, "%zu", k);
+                bench_push(b, &cap, &n, buf);
+            } else {
+                snprintf(buf, sizeof buf, "--%s", b->longopts[i & ~(size_t) 1]);
+                bench_push(b, &cap, &n, buf);
+            }
+            break;
+        case SHAPE_CLUSTERS: {
+            // Clusters of up to 4 short flags
+            size_t n_flags = ((b->n_opts < N_SHORT ? b->n_opts : N_SHORT) + 1) / 2;
+            char * c = buf;
+            *c++ = '-';
+            for (size_t j = 0; j < 4 && j < n_flags; j++)
+                *c++ = opt_short(2 * ((k + j) % n_flags));
+            *c = '\0';
+            bench_push(b, &cap, &n, buf);
+            break;
+        }
+        case SHAPE_REPEATED:
+            if (left >= 2 && k % 2 == 0) {
+                bench_push(b, &cap, &n, "-b");
+                snprintf(buf, sizeof buf, "%zu", k);
+                bench_push(b, &cap, &n, buf);
+            } else {
+                snprintf(buf, sizeof buf, "--option-1=%zu", k);
+                bench_push(b, &cap, &n, buf);
+            }
+            break;
+        case SHAPE_POSITIONAL:
+            if (k % 10 == 0)
+                snprintf(buf, sizeof buf, "--%s=%zu", b->longopts[(i | 1) < b->n_opts ? (i | 1) : 1], k);
+            else
+                snprintf(buf, sizeof buf, "file%zu", k);
+            bench_push(b, &cap, &n, buf);
+            break;
+        case SHAPE_MAX:
+            assert(0);
+        }
+        k++;
+    }
+
+    b->work = malloc(b->pool_len);
+    b->argv = calloc(b->argc + 1, sizeof *b->argv);
+    assert(b->work != NULL && b->argv != NULL);
+}
+
+// Restore the arguments that the parser may have modified or permuted
+static void bench_reset(struct bench * b) {
+    memcpy(b->work, b->pool, b->pool_len);
+    for (size_t i = 0; i < b->argc; i++)
+        b->argv[i] = b->work + b->offsets[i];
+    b->argv[b->argc] = NULL;
+}
+
+// -- Parsers --
+
+static volatile uintptr_t sink;
+
+static int run_optim(struct bench * b) {
+    optim_t * o = optim_start((int) b->argc, b->argv, "[options] [files...]");
+    if (o == NULL) return -1;
+
+    for (size_t i = 0; i < b->n_opts; i++) {
+        if (opt_takes_arg(i)) {
+            optim_arg(o, opt_short(i), b->longopts[i], NULL, "Option with an argument");
+            while (optim_get_count(o) > 0)
+                sink ^= (uintptr_t) optim_get_string(o, NULL);
+        } else {
+            optim_flag(o, opt_short(i), b->longopts[i], "Flag");
+            sink ^= (uintptr_t) optim_get_count(o);
+        }
+    }
+
+    optim_positionals(o);
+    while (optim_get_count(o) > 0)
+        sink ^= (uintptr_t) optim_get_string(o, NULL);
+
+    return optim_finish(&o);
+}
+
+static int run_getopt(struct bench * b, struct option * longopts, const char * optstring, size_t * counts) {
+    memset(counts, 0, b->n_opts * sizeof *counts);
+
+    optind = 0;
+    opterr = 0;
+    int c;
+    int errors = 0;
+    while ((c = getopt_long((int) b->argc, b->argv, optstring, longopts, NULL)) != -1) {
+        size_t i;
+        if (c >= 256) {
+            i = (size_t) c - 256;
+        } else {
+            const char * l = strchr(short_letters, c);
+            if (c == '?' || l == NULL) {
+                errors++;
+                continue;
+            }
+            i = (size_t) (l - short_letters);
+        }
+        counts[i]++;
+        if (opt_takes_arg(i))
+            sink ^= (uintptr_t) optarg;
+    }
+    for (int i = optind; i < (int) b->argc; i++)
+        sink ^= (uintptr_t) b->argv[i];
+
+    return errors ? -1 : 0;
+}
+
+// -- Measurement --
+
+struct result {
+    double ns_per_arg;
+    double allocs;              // Per iteration
+    long rss_kib;               // Growth in peak RSS
+    int rc;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static long peak_rss_kib(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+#define MIN_BENCH_NS 200000000u
+
+static struct result measure(struct bench * b, bool use_getopt) {
+    struct result r = {0};
+
+    struct option * longopts = NULL;
+    char * optstring = NULL;
+    size_t * counts = NULL;
+    if (use_getopt) {
+        longopts = calloc(b->n_opts + 1, sizeof *longopts);
+        optstring = calloc(2 * N_SHORT + 2, 1);
+        counts = calloc(b->n_opts, sizeof *counts);
+        assert(longopts != NULL && optstring != NULL && counts != NULL);
+        char * s = optstring;
+        for (size_t i = 0; i < b->n_opts; i++) {
+            longopts[i] = (struct option) {
+                .name = b->longopts[i],
+                .has_arg = opt_takes_arg(i) ? required_argument : no_argument,
+                .flag = NULL,
+                .val = (int) (256 + i),
+            };
+            if (opt_short(i) != '\0') {
+                *s++ = opt_short(i);
+                if (opt_takes_arg(i))
+                    *s++ = ':';
+            }
+        }
+    }
+
+    long rss_before = peak_rss_kib();
+    uint64_t elapsed = 0;
+    size_t allocs = 0;
+    size_t iters = 0;
+    do {
+        bench_reset(b);
+        n_allocs = 0;
+        uint64_t start = now_ns();
+        int rc = use_getopt ? run_getopt(b, longopts, optstring, counts) : run_optim(b);
+        elapsed += now_ns() - start;
+        allocs += n_allocs;
+        if (rc != 0) r.rc = rc;
+        iters++;
+    } while (elapsed < MIN_BENCH_NS);
+
+    r.ns_per_arg = (double) elapsed / (double) iters / (double) b->argc;
+    r.allocs = (double) allocs / (double) iters;
+    r.rss_kib = peak_rss_kib() - rss_before;
+    return r;
+}
+
+// Run the measurement in a child process, so each has its own peak RSS
+static struct result measure_forked(struct bench * b, bool use_getopt) {
+    struct result r = {.rc = -1};
+
+    int fds[2];
+    if (pipe(fds) != 0) return r;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) return r;
+    if (pid == 0) {
+        close(fds[0]);
+        bench_generate(b);
+        r = measure(b, use_getopt);
+        ssize_t rc = write(fds[1], &r, sizeof r);
+        _exit(rc == sizeof r ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &r, sizeof r) != sizeof r)
+        r.rc = -1;
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return r;
+}
+
+int main(int argc, char ** argv) {
+    optim_t * o = optim_start(argc, argv, "[-s SHAPE] [-n MAX_ARGC] [-o MAX_OPTS]");
+    if (o == NULL) exit(EXIT_FAILURE);
+
+    optim_usage(o, "Compare optim against getopt_long over a matrix of argument shapes\n");
+
+    optim_arg(o, 's', "shape", "SHAPE", "Only run SHAPE: long=val, long val, clusters, repeated, or positional");
+    const char * only_shape = optim_get_string(o, NULL);
+
+    optim_arg(o, 'n', "max-argc", "N", "Largest argc to run [1000000]");
+    long max_argc = optim_get_long(o, 1000000);
+
+    optim_arg(o, 'o', "max-opts", "N", "Largest number of declared options to run [500]");
+    long max_opts = optim_get_long(o, 500);
+
+    if (optim_finish(&o) != 0) exit(EXIT_FAILURE);
+
+    static const size_t argcs[] = {10, 1000, 100000, 1000000};
+    static const size_t n_optss[] = {5, 50, 500};
+
+    printf("%-10s %8s %5s | %12s %8s %8s | %12s %8s %8s\n",
+            "shape", "argc", "opts",
+            "optim ns/arg", "allocs", "rss KiB",
+            "getopt ns/arg", "allocs", "rss KiB");
+
+    for (size_t s = 0; s < SHAPE_MAX; s++) {
+        if (only_shape != NULL && strcmp(only_shape, shape_names[s]) != 0) continue;
+        for (size_t a = 0; a < sizeof argcs / sizeof *argcs; a++) {
+            if (argcs[a] > (size_t) max_argc) continue;
+            for (size_t n = 0; n < sizeof n_optss / sizeof *n_optss; n++) {
+                if (n_optss[n] > (size_t) max_opts) continue;
+
+                struct bench b = {.shape = (enum shape) s, .argc = argcs[a], .n_opts = n_optss[n]};
+                struct result ro = measure_forked(&b, false);
+                struct result rg = measure_forked(&b, true);
+
+                printf("%-10s %8zu %5zu | %12.1f %8.1f %8ld | %12.1f %8.1f %8ld%s\n",
+                        shape_names[s], b.argc, b.n_opts,
+                        ro.ns_per_arg, ro.allocs, ro.rss_kib,
+                        rg.ns_per_arg, rg.allocs, rg.rss_kib,
+                        (ro.rc != 0 || rg.rc != 0) ? "  (parse errors)" : "");
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,623 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "optim.h"
+
+// Checks of parsing results // Checks of parsing results which depend on the order of the declarations errors, which the fuzz targets can only check for crashes
+//
+// make check
+
+static int failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// Start parsing the arguments with a new instance `o`, from an array which optim can modify
+#define START(o, ...) \
+    char * o ## _argv[] = { "optim_check", __VA_ARGS__, NULL }; \
+    optim_t * o = optim_start((int) (sizeof o ## _argv / sizeof *o ## _argv) - 1, o ## _argv, "[options]"); \
+    if (o == NULL) { perror("optim_start"); exit(EXIT_FAILURE); }
+
+// End parsing, without printing the errors
+static int end_silenced(optim_t * o) {
+    fflush(stderr);
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    int rc = optim_end(o);
+    fflush(stderr);
+    dup2(saved, STDERR_FILENO);
+    close(null);
+    close(saved);
+    return rc;
+}
+
+// Check for errors, without printing them
+static int end_quietly(optim_t * o) {
+    optim_positionals(o);
+    optim_get_count(o);
+    return end_silenced(o);
+}
+
+// Finish parsing, without printing the errors
+static int finish(optim_t * o) {
+    int rc = end_quietly(o);
+    optim_finish(&o);
+    return rc;
+}
+
+// The whole name of a long option always goes to that option, in either order, but if an option
+// declared before it already took it as an abbreviation, that's an error
+static void check_exact_long_names(void) {
+    {
+        START(o, "--verb");
+        optim_flag(o, '\0', "verb", "Short name");
+        int verb = optim_get_count(o);
+        optim_flag(o, 'v', "verbose", "Long name");
+        int verbose = optim_get_count(o);
+        CHECK(verb == 1);
+        CHECK(verbose == 0);
+        CHECK(finish(o) == 0);
+    }
+    {
+        START(o, "--verb");
+        optim_flag(o, 'v', "verbose", "Long name");
+        int verbose = optim_get_count(o);
+        optim_flag(o, '\0', "verb", "Short name");
+        int verb = optim_get_count(o);
+        CHECK(verbose == 1);
+        CHECK(verb == 1);
+        CHECK(end_quietly(o) < 0);
+        size_t iter = 0;
+        const struct optim_diag * diag = optim_next_diag(o, &iter);
+        CHECK(diag != NULL && diag->code == OPTIM_DIAG_AMBIGUOUS);
+        CHECK(diag != NULL && strcmp(diag->longopt, "verb") == 0 && strcmp(diag->alt, "verbose") == 0);
+        CHECK(optim_next_diag(o, &iter) == NULL);
+        optim_finish(&o);
+    }
+    {
+        START(o, "--verb", "x");
+        optim_arg(o, 'v', "verbose", "V", "Long name");
+        const char * verbose = optim_get_string(o, NULL);
+        optim_arg(o, '\0', "verb", "V", "Short name");
+        const char * verb = optim_get_string(o, NULL);
+        CHECK(verbose != NULL && strcmp(verbose, "x") == 0);
+        CHECK(verb != NULL && strcmp(verb, "x") == 0);
+        CHECK(finish(o) < 0);
+    }
+    {
+        char verb[] = "--verb=x";
+        START(o, verb);
+        optim_arg(o, 'v', "verbose", "V", "Long name");
+        optim_get_string(o, NULL);
+        struct optim_option table[] = {
+            { '\0', "verb", "V", "Short name", NULL, NULL },
+        };
+        optim_parse_table(o, table, 1);
+        CHECK(finish(o) < 0);
+    }
+    {
+        // Without any long options in the table, nothing can be abbreviated
+        START(o, "--v");
+        optim_parse_table(o, NULL, 0);
+        struct optim_option table[] = {
+            { 'v', NULL, NULL, "Short name", NULL, NULL },
+        };
+        optim_parse_table(o, table, 1);
+        CHECK(finish(o) < 0);
+    }
+    {
+        // Still ambiguous if it isn't a whole name
+        START(o, "--ver");
+        optim_flag(o, 'v', "verbose", "Long name");
+        optim_get_count(o);
+        optim_flag(o, '\0', "verb", "Short name");
+        optim_get_count(o);
+        CHECK(finish(o) < 0);
+    }
+}
+
+// The letters after an option which takes an argument are its argument, or an error
+static void check_attached_short_args(void) {
+    {
+        START(o, "-po/tmp/p");
+        optim_arg(o, 'o', NULL, "PATH", "Output");
+        const char * out = optim_get_string(o, NULL);
+        optim_flag(o, 'p', NULL, "Flag");
+        int p = optim_get_count(o);
+        CHECK(out != NULL && strcmp(out, "/tmp/p") == 0);
+        CHECK(p == 1);
+        CHECK(finish(o) == 0);
+    }
+    {
+        // The flag has already counted the letters of the argument
+        START(o, "-o/tmp/p");
+        optim_flag(o, 'p', NULL, "Flag");
+        optim_get_count(o);
+        optim_arg(o, 'o', NULL, "PATH", "Output");
+        CHECK(optim_get_string(o, NULL) == NULL);
+        CHECK(finish(o) < 0);
+    }
+    {
+        START(o, "-o/tmp/p");
+        optim_flag(o, 'p', NULL, "Flag");
+        optim_get_count(o);
+        optim_arg(o, 'o', NULL, "PATH", "Output");
+        optim_get_string(o, NULL);
+        CHECK(end_quietly(o) < 0);
+        size_t iter = 0;
+        const struct optim_diag * diag = optim_next_diag(o, &iter);
+        CHECK(diag != NULL && diag->code == OPTIM_DIAG_TAKEN_ARG && diag->opt == 'o');
+        CHECK(optim_next_diag(o, &iter) == NULL);
+        optim_finish(&o);
+    }
+}
+
+// Each mistake is reported once, as what it is
+static void check_diag_codes(void) {
+    {
+        // optim writes over the '='
+        char verbose[] = "--verbose=3";
+        START(o, verbose);
+        optim_flag(o, 'v', "verbose", "Flag");
+        optim_get_count(o);
+        CHECK(end_quietly(o) < 0);
+        size_t iter = 0;
+        const struct optim_diag * diag = optim_next_diag(o, &iter);
+        CHECK(diag != NULL && diag->code == OPTIM_DIAG_UNEXPECTED_ARG);
+        CHECK(optim_next_diag(o, &iter) == NULL);
+        optim_finish(&o);
+    }
+    {
+        START(o, "-v");
+        optim_flag(o, '\0', NULL, "Neither name");
+        optim_error(o, "Internal optim error, says the program");
+        CHECK(end_quietly(o) < 0);
+        size_t iter = 0;
+        const struct optim_diag * diag = optim_next_diag(o, &iter);
+        CHECK(diag != NULL && diag->code == OPTIM_DIAG_INTERNAL);
+        diag = optim_next_diag(o, &iter);
+        CHECK(diag != NULL && diag->code == OPTIM_DIAG_ERROR);
+        optim_finish(&o);
+    }
+}
+
+// Split the `len` bytes of `buf` with `optim_start_string`, and compare the words after the
+// invocation with the `n` in `expected`
+static bool split_as(char * buf, size_t len, const char * const * expected, size_t n) {
+    optim_t * o = optim_start_string(buf, len, "[words]");
+    if (o == NULL)
+        return false;
+    optim_positionals(o);
+    const char * words[8] = {NULL};
+    size_t got = optim_get_strings(o, words, 8);
+    bool same = got == n;
+    for (size_t i = 0; i < n && same; i++)
+        same = strcmp(words[i], expected[i]) == 0;
+    if (!same) {
+        fprintf(stderr, "Split into %zu words:", got);
+        for (size_t i = 0; i < got; i++)
+            fprintf(stderr, " [%s]", words[i]);
+        fprintf(stderr, "\n");
+    }
+    int rc = end_silenced(o);
+    optim_finish(&o);
+    return same && rc == 0;
+}
+
+#define CHECK_SPLIT(text, ...) do { \
+        char text_buf[] = text; \
+        const char * expected[] = { __VA_ARGS__ }; \
+        CHECK(split_as(text_buf, sizeof text_buf - 1, expected, sizeof expected / sizeof *expected)); \
+    } while (0)
+
+// Command strings are split into words like a shell would
+static void check_string_split(void) {
+    CHECK_SPLIT("prog a  b\tc\n", "a", "b", "c");
+    CHECK_SPLIT("  prog 'x  y' \"z w\"", "x  y", "z w");
+    CHECK_SPLIT("prog 'a'\"b\"c", "abc");
+    CHECK_SPLIT("prog '\\' \"\\\"\\\\\\$\\e\"", "\\", "\"\\$\\e");
+    CHECK_SPLIT("prog a\\ b \\'", "a b", "'");
+    // Quotes make empty words, which are skipped like empty arguments in `argv`
+    CHECK_SPLIT("prog '' \"\" x", "x");
+    CHECK_SPLIT("prog a\\\nb \"c\\\nd\"", "ab", "cd");
+    CHECK_SPLIT("prog @response_file", "@response_file");
+    {
+        // The string ends at `len`, or at a NUL
+        char buf[] = "prog a b";
+        const char * expected[] = { "a" };
+        CHECK(split_as(buf, 6, expected, 1));
+        char nul[] = "prog a\0b";
+        CHECK(split_as(nul, sizeof nul - 1, expected, 1));
+    }
+    {
+        // The last word can't be terminated in place if it reaches the end
+        char buf[8] = "prog abc";
+        const char * expected[] = { "abc" };
+        CHECK(split_as(buf, sizeof buf, expected, 1));
+    }
+    {
+        char buf[] = "   ";
+        CHECK(split_as(buf, sizeof buf - 1, NULL, 0));
+        CHECK(split_as(buf, 0, NULL, 0));
+    }
+}
+
+// A quoting error in a command string is reported with its position
+static void check_string_quoting_error(void) {
+    char buf[] = "prog -v \"unterminated";
+    optim_t * o = optim_start_string(buf, sizeof buf - 1, "[options]");
+    CHECK(o != NULL);
+    if (o == NULL) return;
+    size_t iter = 0;
+    const struct optim_diag * diag = optim_next_diag(o, &iter);
+    CHECK(diag != NULL && diag->code == OPTIM_DIAG_QUOTING);
+    CHECK(diag != NULL && strcmp(diag->text, "Unterminated double quote at byte 8") == 0);
+    optim_flag(o, 'v', NULL, "Flag");
+    CHECK(optim_get_count(o) == 1);
+    CHECK(finish(o) < 0);
+}
+
+// Each kind of quoting error, & the words before it
+static void check_string_quoting_errors(void) {
+    static const struct {
+        const char * text;
+        const char * message;
+    } cases[] = {
+        { "prog a 'b", "Unterminated single quote at byte 7" },
+        { "prog a \"b\\\"", "Unterminated double quote at byte 7" },
+        { "prog a b\\", "Trailing backslash at byte 8" },
+    };
+    for (size_t i = 0; i < sizeof cases / sizeof *cases; i++) {
+        char buf[32];
+        snprintf(buf, sizeof buf, "%s", cases[i].text);
+        optim_t * o = optim_start_string(buf, strlen(buf), "[words]");
+        CHECK(o != NULL);
+        if (o == NULL) continue;
+        size_t iter = 0;
+        const struct optim_diag * diag = optim_next_diag(o, &iter);
+        CHECK(diag != NULL && diag->code == OPTIM_DIAG_QUOTING && strcmp(diag->text, cases[i].message) == 0);
+        optim_positionals(o);
+        const char * words[4] = {NULL};
+        CHECK(optim_get_strings(o, words, 4) == 1 && strcmp(words[0], "a") == 0);
+        CHECK(end_silenced(o) < 0);
+        optim_finish(&o);
+    }
+}
+
+// Parse the positional `value` with `optim_positionals_longs`, returning `false` on error
+static bool positional_long(const char * value, long * out) {
+    START(o, "--", (char *) value);
+    size_t parsed = 0;
+    int rc = optim_positionals_longs(o, out, 1, &parsed);
+    int end = end_silenced(o);
+    optim_finish(&o);
+    return rc == 0 && parsed == 1 && end == 0;
+}
+
+static bool positional_uint64(const char * value, uint64_t * out) {
+    START(o, "--", (char *) value);
+    size_t parsed = 0;
+    int rc = optim_positionals_uint64s(o, out, 1, &parsed);
+    int end = end_silenced(o);
+    optim_finish(&o);
+    return rc == 0 && parsed == 1 && end == 0;
+}
+
+// Parse `value` as the argument of `--value` with `optim_get_size`, or `optim_get_duration`
+static bool get_size(const char * value, uint64_t * out) {
+    START(o, "--value", (char *) value);
+    optim_arg(o, '\0', "value", "SIZE", "Size");
+    *out = optim_get_size(o, 0);
+    return finish(o) == 0;
+}
+
+static bool get_duration(const char * value, uint64_t * out) {
+    START(o, "--value", (char *) value);
+    optim_arg(o, '\0', "value", "DURATION", "Duration");
+    *out = optim_get_duration(o, 0);
+    return finish(o) == 0;
+}
+
+// Decimal numbers are parsed 8 digits at a time, with the digits before that one at a time
+static void check_numbers(void) {
+    long x = 0;
+    CHECK(positional_long("0", &x) && x == 0);
+    CHECK(positional_long("7", &x) && x == 7);
+    CHECK(positional_long("12345678", &x) && x == 12345678);
+    CHECK(positional_long("123456789", &x) && x == 123456789);
+    CHECK(positional_long("-87654321", &x) && x == -87654321);
+    CHECK(positional_long("+1234567890123456", &x) && x == 1234567890123456);
+    CHECK(positional_long("9223372036854775807", &x) && x == 9223372036854775807);
+    CHECK(positional_long("-9223372036854775808", &x) && x == -9223372036854775807 - 1);
+    CHECK(!positional_long("9223372036854775808", &x));
+    CHECK(!positional_long("99999999999999999999", &x));
+    // A bad digit in each part of the number
+    CHECK(!positional_long("1234567a", &x));
+    CHECK(!positional_long("a23456789", &x));
+    CHECK(!positional_long("12345678:", &x));
+    CHECK(!positional_long("", &x));
+    // Other forms are parsed like `strtol`
+    CHECK(positional_long("010", &x) && x == 8);
+    CHECK(positional_long("0x10", &x) && x == 16);
+
+    {
+        // The whole list is parsed, up to the first bad number
+        START(o, "1", "22", "x", "4");
+        long out[4] = {0};
+        size_t parsed = 0;
+        CHECK(optim_positionals_longs(o, out, 4, &parsed) < 0);
+        CHECK(parsed == 2 && out[0] == 1 && out[1] == 22);
+        CHECK(end_silenced(o) < 0);
+        optim_finish(&o);
+    }
+    {
+        START(o, "--", "0.5", "-2.25", "1e3");
+        double out[3] = {0};
+        size_t parsed = 0;
+        CHECK(optim_positionals_doubles(o, out, 3, &parsed) == 0);
+        CHECK(parsed == 3 && out[0] == 0.5 && out[1] == -2.25 && out[2] == 1000.0);
+        CHECK(end_silenced(o) == 0);
+        optim_finish(&o);
+    }
+}
+
+// Unsigned 64-bit numbers are parsed in blocks up to 19 digits, and the 20th can overflow
+static void check_uint64s(void) {
+    uint64_t x = 0;
+    CHECK(positional_uint64("87654321", &x) && x == 87654321);
+    CHECK(positional_uint64("1234567890123456789", &x) && x == UINT64_C(1234567890123456789));
+    CHECK(positional_uint64("9999999999999999999", &x) && x == UINT64_C(9999999999999999999));
+    CHECK(positional_uint64("18446744073709551615", &x) && x == UINT64_MAX);
+    CHECK(!positional_uint64("18446744073709551616", &x));
+    CHECK(!positional_uint64("99999999999999999999", &x));
+    CHECK(positional_uint64("0xffffffffffffffff", &x) && x == UINT64_MAX);
+    CHECK(!positional_uint64("0x10000000000000000", &x));
+    // `strtoull` would negate these
+    CHECK(!positional_uint64("-1", &x));
+    CHECK(!positional_uint64(" -1", &x));
+}
+
+// Sizes have binary suffixes, and durations have units; both are errors if they overflow
+static void check_units(void) {
+    uint64_t x = 0;
+    CHECK(get_size("0", &x) && x == 0);
+    CHECK(get_size("512B", &x) && x == 512);
+    CHECK(get_size("64K", &x) && x == 64 << 10);
+    CHECK(get_size("1MiB", &x) && x == 1 << 20);
+    CHECK(get_size("2g", &x) && x == (uint64_t) 2 << 30);
+    CHECK(get_size("15E", &x) && x == (uint64_t) 15 << 60);
+    CHECK(!get_size("16E", &x));
+    CHECK(!get_size("18446744073709551616", &x));
+    CHECK(!get_size("1X", &x));
+    CHECK(!get_size("K", &x));
+    CHECK(!get_size("-1K", &x));
+
+    CHECK(get_duration("250ms", &x) && x == 250000000);
+    CHECK(get_duration("1h30m", &x) && x == UINT64_C(5400000000000));
+    CHECK(get_duration("1.5s", &x) && x == 1500000000);
+    CHECK(get_duration("2", &x) && x == 2000000000);
+    CHECK(get_duration("3us", &x) && x == 3000);
+    CHECK(get_duration("1d", &x) && x == UINT64_C(86400000000000));
+    CHECK(!get_duration("5m1", &x));
+    CHECK(!get_duration("1w", &x));
+    CHECK(!get_duration("ms", &x));
+    CHECK(!get_duration("300000d", &x));
+}
+
+// Write `text` to a new temporary file, whose path is returned in `path`
+static void write_temp(char * path, size_t len, const char * text) {
+    const char * dir = getenv("TMPDIR");
+    snprintf(path, len, "%s/optim_check_XXXXXX", dir != NULL ? dir : "/tmp");
+    int fd = mkstemp(path);
+    if (fd < 0) { perror("mkstemp"); exit(EXIT_FAILURE); }
+    size_t n = strlen(text);
+    if (write(fd, text, n) != (ssize_t) n) { perror("write"); exit(EXIT_FAILURE); }
+    close(fd);
+}
+
+// Config files set options which weren't given on the command line
+static void check_config_file(void) {
+    char path[256];
+    {
+        write_temp(path, sizeof path, "# comment\n; comment\n[section]\n\nalpha = 3\n  beta  \ngamma = off\n"
+            "delta = \"quoted value\"\nverbose = yes\nepsilon=unterminated last line");
+        START(o, "--alpha", "5");
+        CHECK(optim_config_file(o, path) == 0);
+        optim_arg(o, 'a', "alpha", "A", "Given on the command line too");
+        const char * alpha = optim_get_string(o, NULL);
+        CHECK(alpha != NULL && strcmp(alpha, "5") == 0);
+        CHECK(optim_get_count(o) == 0);
+        optim_flag(o, 'b', "beta", "Flag");
+        CHECK(optim_get_count(o) == 1);
+        optim_flag(o, 'g', "gamma", "Flag set to false");
+        CHECK(optim_get_count(o) == 0);
+        optim_arg(o, 'd', "delta", "D", "Quoted");
+        const char * delta = optim_get_string(o, NULL);
+        CHECK(delta != NULL && strcmp(delta, "quoted value") == 0);
+        optim_flag(o, 'v', "verbose", "Flag set to true");
+        CHECK(optim_get_count(o) == 1);
+        optim_arg(o, 'e', "epsilon", "E", "Last line");
+        const char * epsilon = optim_get_string(o, NULL);
+        CHECK(epsilon != NULL && strcmp(epsilon, "unterminated last line") == 0);
+        CHECK(finish(o) == 0);
+        unlink(path);
+    }
+    {
+        // Errors are reported with the line they're on
+        write_temp(path, sizeof path, "verbose = maybe\n= 3\n");
+        START(o, "--");
+        CHECK(optim_config_file(o, path) < 0);
+        optim_flag(o, 'v', "verbose", "Flag");
+        CHECK(optim_get_count(o) == 0);
+        CHECK(end_quietly(o) < 0);
+        size_t iter = 0;
+        const struct optim_diag * diag = optim_next_diag(o, &iter);
+        CHECK(diag != NULL && diag->code == OPTIM_DIAG_CONFIG_SYNTAX && diag->line == 2 && strcmp(diag->path, path) == 0);
+        diag = optim_next_diag(o, &iter);
+        CHECK(diag != NULL && diag->code == OPTIM_DIAG_NOT_BOOL && diag->line == 1 && strcmp(diag->value, "maybe") == 0);
+        CHECK(optim_next_diag(o, &iter) == NULL);
+        optim_finish(&o);
+        unlink(path);
+    }
+    {
+        // An empty file has no options
+        write_temp(path, sizeof path, "");
+        START(o, "--");
+        CHECK(optim_config_file(o, path) == 0);
+        optim_flag(o, 'v', "verbose", "Flag");
+        CHECK(optim_get_count(o) == 0);
+        CHECK(finish(o) == 0);
+        unlink(path);
+    }
+    {
+        START(o, "--");
+        CHECK(optim_config_file(o, "/nonexistent/optim_check.conf") < 0);
+        CHECK(finish(o) == 0);
+    }
+}
+
+// Make the declarations of `check_snapshot`, and check their results
+static void snapshot_declare(optim_t * o) {
+    optim_flag(o, 'v', "verbose", "Flag");
+    CHECK(optim_get_count(o) == 2);
+    optim_arg(o, 'n', "name", "NAME", "Name");
+    const char * name = optim_get_string(o, NULL);
+    CHECK(name != NULL && strcmp(name, "x") == 0);
+    optim_positionals(o);
+    const char * positionals[3] = {NULL};
+    CHECK(optim_get_strings(o, positionals, 3) == 2);
+    CHECK(positionals[0] != NULL && strcmp(positionals[0], "p1") == 0);
+    CHECK(positionals[1] != NULL && strcmp(positionals[1], "p2") == 0);
+}
+
+// Snapshots replay the same results, and are rejected if they're truncated or corrupt
+static void check_snapshot(void) {
+    static uint64_t buf[256];
+    static uint64_t copy[256];
+    size_t size = 0;
+    {
+        START(o, "-vv", "--name", "x", "p1", "p2");
+        snapshot_declare(o);
+        size = optim_snapshot(o, NULL, 0);
+        CHECK(size > 0 && size < sizeof buf);
+        if (size == 0 || size >= sizeof buf) {
+            optim_finish(&o);
+            return;
+        }
+        CHECK(optim_snapshot(o, buf, size) == size);
+        CHECK(finish(o) == 0);
+    }
+    {
+        optim_t * o = optim_from_snapshot(buf, size);
+        CHECK(o != NULL);
+        if (o != NULL) {
+            snapshot_declare(o);
+            CHECK(optim_finish(&o) == 0);
+        }
+    }
+    {
+        // The declarations have to match
+        optim_t * o = optim_from_snapshot(buf, size);
+        CHECK(o != NULL);
+        if (o != NULL) {
+            optim_flag(o, 'q', "quiet", "Flag");
+            optim_get_count(o);
+            CHECK(end_silenced(o) < 0);
+            optim_finish(&o);
+        }
+    }
+
+    for (size_t len = 0; len < size; len++) {
+        errno = 0;
+        CHECK(optim_from_snapshot(buf, len) == NULL && errno == EINVAL);
+    }
+    for (size_t i = 0; i < size; i++) {
+        memcpy(copy, buf, size);
+        ((unsigned char *) copy)[i] ^= 0x10;
+        optim_t * o = optim_from_snapshot(copy, size);
+        CHECK(o == NULL);
+        if (o != NULL) {
+            fprintf(stderr, "Byte %zu of the snapshot was corrupt\n", i);
+            optim_finish(&o);
+        }
+    }
+    // It has to be aligned
+    memcpy((char *) copy + 1, buf, size);
+    CHECK(optim_from_snapshot((char *) copy + 1, size) == NULL);
+}
+
+// Response files are only read by `optim_start_expand`
+static void check_response_files(void) {
+    char path[256];
+    write_temp(path, sizeof path, "-v\nfrom file\n");
+    char arg[260];
+    snprintf(arg, sizeof arg, "@%s", path);
+    const char * words[4] = {NULL};
+    {
+        START(o, arg);
+        optim_flag(o, 'v', NULL, "Flag");
+        CHECK(optim_get_count(o) == 0);
+        optim_positionals(o);
+        CHECK(optim_get_strings(o, words, 4) == 1 && strcmp(words[0], arg) == 0);
+        CHECK(finish(o) == 0);
+    }
+    {
+        char * argv[] = { "optim_check", arg, NULL };
+        optim_t * o = optim_start_expand(2, argv, "[options]");
+        CHECK(o != NULL);
+        if (o == NULL) return;
+        for (int pass = 0; pass < 2; pass++) {
+            optim_flag(o, 'v', NULL, "Flag");
+            CHECK(optim_get_count(o) == 1);
+            optim_positionals(o);
+            CHECK(optim_get_strings(o, words, 4) == 1 && strcmp(words[0], "from file") == 0);
+            CHECK(end_silenced(o) == 0);
+            // `optim_reset` keeps expanding them
+            CHECK(pass == 1 || optim_reset(o, 2, argv) == 0);
+        }
+        optim_finish(&o);
+    }
+    unlink(path);
+}
+
+// Programs only write generated files if optim was built for it
+static void check_no_generate(void) {
+    char generate[] = "--optim-generate-c=optim_check_generated.c";
+    START(o, generate);
+    CHECK(finish(o) < 0);
+    CHECK(access("optim_check_generated.c", F_OK) != 0);
+    unlink("optim_check_generated.c");
+}
+
+int main(void) {
+    check_exact_long_names();
+    check_attached_short_args();
+    check_diag_codes();
+    check_no_generate();
+    check_string_split();
+    check_string_quoting_error();
+    check_string_quoting_errors();
+    check_numbers();
+    check_uint64s();
+    check_units();
+    check_config_file();
+    check_snapshot();
+    check_response_files();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All checks passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,338 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "optim.h"
+
+// In-process fuzz target for libFuzzer & AFL++ persistent mode
+//
+// Each input is a schedule of declarations followed by the arguments:
+//
+//     <n> <n schedule bytes> <arg1> '\n' <arg2> '\n' ...
+//
+// The arguments are split into an argv in memory, and the schedule drives a whole
+// `optim_start` -> declarations -> `optim_finish` sequence, so no files are read and
+// no processes are started per input.
+//
+// libFuzzer:   make optim_fuzz && ./optim_fuzz -close_fd_mask=3 corpus/
+// AFL++:       make optim_fuzz_afl && afl-fuzz -i corpus/ -o findings/ -- ./optim_fuzz_afl
+// Otherwise, `optim_fuzz_afl` runs each input file given on the command line once.
+
+// Options to choose declarations from; some names are prefixes of others, and some repeat
+static const struct optim_option fuzz_options[] = {
+    {'a', "alpha", "N", "Alpha", NULL, NULL},
+    {'b', "beta", NULL, "Beta", NULL, NULL},
+    {'c', NULL, NULL, "C flag without longform", NULL, NULL},
+    {'\0', "delta", "DIFF", "Delta\nwith a second line", NULL, NULL},
+    {'e', NULL, "EXARG", "Extra option with an arg but no longopt", NULL, NULL},
+    {'v', "verbose", NULL, "Increase verbosity", NULL, NULL},
+    {'x', "ex", NULL, NULL, NULL, NULL},
+    {'\0', "exa", "VALUE", "A long option which extends another", NULL, NULL},
+    {'a', "also", "N", "Repeats a short option", NULL, NULL},
+    {'\0', NULL, NULL, "\nTable text:\n", NULL, NULL},
+};
+#define FUZZ_N_OPTIONS (sizeof fuzz_options / sizeof *fuzz_options)
+
+static const char * const fuzz_envs[] = { "OPTIM_FUZZ_A", "OPTIM_FUZZ_B", "HOME", "OPTIM_FUZZ_UNSET" };
+static const char * const fuzz_subcommands[] = { "show", "shove", "s", "log" };
+
+// Cursor over the schedule bytes; reads as 0 once they run out
+struct fuzz_schedule {
+    const uint8_t * bytes;
+    size_t len;
+    size_t pos;
+};
+
+static uint8_t fuzz_next(struct fuzz_schedule * schedule) {
+    if (schedule->pos >= schedule->len)
+        return 0;
+    return schedule->bytes[schedule->pos++];
+}
+
+// Arena for `optim_start_arena`, aligned for any type
+static union {
+    long double ld;
+    void * ptr;
+    char buf[1 << 16];
+} fuzz_arena;
+
+// Buffer for `optim_snapshot`, aligned like a mapping
+static union {
+    uint64_t align;
+    char buf[1 << 16];
+} fuzz_snapshot_buf;
+
+// Copy the arguments from the input into `*buf`, and split them into `argv`
+// Returns `argc`, or `-1` if out of memory
+static int fuzz_argv(const uint8_t * data, size_t size, char ** buf, char *** argv) {
+    size_t argc = 1;
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == '\n')
+            argc++;
+    }
+
+    *buf = malloc(size + 1);
+    *argv = calloc(argc + 2, sizeof **argv);
+    if (*buf == NULL || *argv == NULL)
+        return -1;
+    memcpy(*buf, data, size);
+    (*buf)[size] = '\0';
+
+    (*argv)[0] = "optim_fuzz";
+    size_t n = 1;
+    if (size > 0) {
+        (*argv)[n++] = *buf;
+        for (size_t i = 0; i < size; i++) {
+            if ((*buf)[i] != '\n') continue;
+            (*buf)[i] = '\0';
+            (*argv)[n++] = &(*buf)[i + 1];
+        }
+    }
+    return (int) n;
+}
+
+// Would parsing `argv` write a file with `--optim-generate-*`, or read a response file (`@path`)?
+// `@path` is only expanded before "--", but any is skipped
+static bool fuzz_touches_files(int argc, char ** argv) {
+    if (argc > 1 && strncmp(argv[1], "--optim-generate-", 17) == 0)
+        return true;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '@' && argv[i][1] != '\0')
+            return true;
+    }
+    return false;
+}
+
+// Read the current option with one of the getters
+static void fuzz_get(optim_t * optim, uint8_t x) {
+    const char * strs[4];
+    long longs[4];
+    switch (x % 10) {
+    case 0:
+        while (optim_get_count(optim) > 0)
+            optim_get_string(optim, NULL);
+        break;
+    case 1: optim_get_string(optim, "empty"); break;
+    case 2: optim_get_long(optim, -1); break;
+    case 3: optim_get_ulong(optim, 0); break;
+    case 4: optim_get_double(optim, 0.5); break;
+    case 5: optim_get_size(optim, 0); break;
+    case 6: optim_get_duration(optim, 0); break;
+    case 7: optim_get_strings(optim, strs, x % 5); break;
+    case 8: optim_get_longs(optim, longs, x % 5); break;
+    case 9: optim_get_count(optim); break;
+    }
+}
+
+// Run the declarations from `schedule` against `optim`
+// Subcommands are run with the rest of the schedule, down to `depth` levels
+static void fuzz_declare(optim_t * optim, struct fuzz_schedule * schedule, int depth) {
+    struct optim_option table[8];
+    int counts[8];
+    const char * values[8];
+
+    while (schedule->pos < schedule->len) {
+        uint8_t op = fuzz_next(schedule);
+        uint8_t x = fuzz_next(schedule);
+        const struct optim_option * option = &fuzz_options[x % FUZZ_N_OPTIONS];
+        switch (op % 16) {
+        case 0:
+        case 1:
+            optim_arg(optim, option->opt, option->longopt, option->metavar, option->help);
+            fuzz_get(optim, fuzz_next(schedule));
+            break;
+        case 2:
+        case 3:
+            optim_flag(optim, option->opt, option->longopt, option->help);
+            optim_get_count(optim);
+            break;
+        case 4:
+            optim_env(optim, fuzz_envs[x % 4]);
+            fuzz_get(optim, fuzz_next(schedule));
+            break;
+        case 5:
+            optim_env_prefix(optim, x % 2 ? "OPTIM_FUZZ_" : "");
+            break;
+        case 6:
+            if (x % 2)
+                optim_usage(optim, "Section %d:\n", x);
+            else
+                optim_usage(optim, "\nSection:\n");
+            break;
+        case 7:
+            optim_version(optim, "optim_fuzz %d\n", x);
+            break;
+        case 8: {
+            size_t n = x % 9;
+            for (size_t i = 0; i < n; i++) {
+                table[i] = fuzz_options[fuzz_next(schedule) % FUZZ_N_OPTIONS];
+                table[i].count = &counts[i];
+                table[i].value = &values[i];
+                values[i] = NULL;
+            }
+            optim_parse_table(optim, table, n);
+            break;
+        }
+        case 9: {
+            optim_error(optim, "Fuzz error %d", x);
+            // Format every diagnostic so far, into a buffer which is sometimes too short
+            char buf[64];
+            size_t iter = 0;
+            const struct optim_diag * diag;
+            while ((diag = optim_next_diag(optim, &iter)) != NULL)
+                optim_format_diag(diag, buf, x % sizeof buf);
+            break;
+        }
+        case 10:
+            optim_subcommand(optim, fuzz_subcommands[x % 4], "[options]", x % 2 ? "A subcommand" : NULL);
+            break;
+        case 11: {
+            optim_t * child = NULL;
+            optim_get_subcommand(optim, &child);
+            if (child != NULL && depth > 0)
+                fuzz_declare(child, schedule, depth - 1);
+            break;
+        }
+        case 12: {
+            // Some of the positionals are converted in bulk
+            long longs[4];
+            uint64_t uint64s[4];
+            double doubles[4];
+            size_t parsed;
+            switch (x % 4) {
+            case 0: optim_positionals(optim); break;
+            case 1: optim_positionals_longs(optim, longs, x % 5, &parsed); break;
+            case 2: optim_positionals_uint64s(optim, uint64s, x % 5, &parsed); break;
+            case 3: optim_positionals_doubles(optim, doubles, x % 5, NULL); break;
+            }
+            fuzz_get(optim, x);
+            break;
+        }
+        case 13:
+            optim_unused(optim);
+            fuzz_get(optim, x);
+            break;
+        case 14:
+            fuzz_get(optim, x);
+            break;
+        case 15: {
+            struct optim_stats stats;
+            optim_stats(optim, &stats);
+            break;
+        }
+        }
+    }
+}
+
+// Replay the results of `optim` from a snapshot, with the same declarations
+// A snapshot which can't be opened is a crash; the replay can still report errors, since the
+// schedule can read an option before `optim_env` changes it
+static void fuzz_snapshot(optim_t * optim, struct fuzz_schedule * schedule) {
+    size_t size = optim_snapshot(optim, NULL, 0);
+    if (size == 0 || size > sizeof fuzz_snapshot_buf)
+        return;
+    if (optim_snapshot(optim, &fuzz_snapshot_buf, size) != size)
+        abort();
+
+    optim_t * replay = optim_from_snapshot(&fuzz_snapshot_buf, size);
+    if (replay == NULL)
+        abort();
+    schedule->pos = 0;
+    fuzz_declare(replay, schedule, 1);
+    optim_finish(&replay);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size) {
+    if (size < 2)
+        return 0;
+
+    // The first byte is the length of the schedule; the second picks how to start
+    size_t n = data[0];
+    uint8_t mode = data[1];
+    data += 2;
+    size -= 2;
+    if (n > size)
+        n = size;
+    struct fuzz_schedule schedule = { .bytes = data, .len = n, .pos = 0 };
+    data += n;
+    size -= n;
+
+    char * buf = NULL;
+    char ** argv = NULL;
+    int argc = fuzz_argv(data, size, &buf, &argv);
+    optim_t * optim = NULL;
+    if (argc < 0)
+        goto done;
+    // Don't let inputs read or write files; a command string can't do either, since
+    // `optim_start_string` never expands `@path` or checks for `--optim-generate-*`
+    if (fuzz_touches_files(argc, argv))
+        goto done;
+
+    if (mode & 0x40) {
+        // Split the arguments from the input as a command string instead, in place in `buf`
+        memcpy(buf, data, size);
+        optim = optim_start_string(buf, size, "[options] <path>");
+    } else if (mode % 2)
+        optim = optim_start_arena(argc, argv, "[options] <path>", &fuzz_arena, 256 + (size_t) (mode / 2) * 512);
+    else
+        optim = optim_start_expand(argc, argv, "[options] <path>");
+    if (optim == NULL)
+        goto done;
+
+    // Optionally parse everything a second time, reusing the instance
+    if (mode & 0x80) {
+        fuzz_declare(optim, &schedule, 1);
+        optim_end(optim);
+
+        free(buf);
+        free(argv);
+        buf = NULL;
+        argv = NULL;
+        argc = fuzz_argv(data, size, &buf, &argv);
+        if (argc < 0 || optim_reset(optim, argc, argv) < 0)
+            goto done;
+        schedule.pos = 0;
+    }
+
+    fuzz_declare(optim, &schedule, 1);
+    fuzz_snapshot(optim, &schedule);
+
+done:
+    if (optim != NULL)
+        optim_finish(&optim);
+    free(buf);
+    free(argv);
+    return 0;
+}
+
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+__AFL_FUZZ_INIT();
+
+// AFL++ persistent mode: run many inputs in one process, from shared memory
+int main(void) {
+    __AFL_INIT();
+    const uint8_t * data = __AFL_FUZZ_TESTCASE_BUF;
+    while (__AFL_LOOP(100000))
+        LLVMFuzzerTestOneInput(data, (size_t) __AFL_FUZZ_TESTCASE_LEN);
+    return 0;
+}
+#elif !defined(OPTIM_LIBFUZZER)
+// Run each input file once, to reproduce a crash without a fuzzer
+int main(int argc, char ** argv) {
+    for (int i = 1; i < argc; i++) {
+        FILE * f = fopen(argv[i], "rb");
+        if (f == NULL) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        static uint8_t data[1 << 20];
+        size_t size = fread(data, 1, sizeof data, f);
+        fclose(f);
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    return 0;
+}
+#endif
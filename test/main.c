@@ -6,41 +6,16 @@
 
 #include "optim.h"
 
-// If the first argument is just "afl",
-// then load the command line options from a newline-delimited file
-// This makes it easy to fuzz with afl
-static void handle_afl(int * argc, char *** argv) {
-    if (*argc != 3) return;
-    if (strcmp((*argv)[1], "afl") != 0) return;
-
-    static char buffer[1 << 20];
-    static char * new_argv[256];
-    FILE * f = fopen((*argv)[2], "r");
-    assert(f != NULL);
-    size_t rc = fread(buffer, sizeof buffer, 1, f);
-    (void) rc;
-    fclose(f);
-    buffer[sizeof(buffer) - 1] = '\0';
-    char * sptr = NULL;
-    new_argv[0] = (*argv)[0];
-    new_argv[1] = strtok_r(buffer, "\n", &sptr);
-    int new_argc = 2;
-    for (size_t i = 2; i < sizeof new_argv; i++) {
-        new_argv[i] = strtok_r(NULL, "\n", &sptr);
-        if (new_argv[i] != NULL && new_argv[i][0] != '\0')
-            new_argc++;
-        else
-            break;
-    }
-
-    *argc = new_argc;
-    *argv = new_argv;
-}
-
 int main(int argc, char ** argv) {
-    handle_afl(&argc, &argv);
-
-    optim_t * o = optim_start(argc, argv, "[-a] [-b] <path>");
+    // If the first argument is just "afl",
+    // then load the command line options from a newline-delimited file
+    // This makes it easy to fuzz with afl
+    // (`test/fuzz.c` is much faster, since it fuzzes in-process)
+    optim_t * o = NULL;
+    if (argc == 3 && strcmp(argv[1], "afl") == 0)
+        o = optim_start_file(argv[0], argv[2], "[-a] [-b] <path>");
+    else
+        o = optim_start(argc, argv, "[-a] [-b] <path>");
     assert(o != NULL);
 
     optim_usage(o, "My test optim program\n");